@@ -1,12 +1,14 @@
-/* matrix summation using pthreads
+/* matrix summation using the shared task runtime
  
- features: uses a barrier; the Worker[0] computes
- the total sum, minumum element value and maxmimum
- element value from partial values computed by Workers
- and prints the total sum to the standard output
+ features: uses a barrier; each strip of the matrix is
+ a task of a parallel for, whose end is the barrier. Then
+ the main thread computes the total sum, minumum element
+ value and maxmimum element value from partial values
+ computed by Workers and prints the total sum to the
+ standard output
  
  usage under Linux:
- gcc a.c -lpthread
+ g++ a.c -lpthread
  a [size] [numWorkers]
  
  */
@@ -19,6 +21,7 @@
 #include <stdbool.h>
 #include <time.h>
 #include <sys/time.h>
+#include "../common/runtime.h"
 #define MAXSIZE 10000  /* maximum matrix size */
 #define MAXWORKERS 10   /* maximum number of workers */
 
@@ -30,22 +33,8 @@
 #define MINROW 4
 #define MINCOL 5
 
-pthread_mutex_t barrier;  /* mutex lock for the barrier */
-pthread_cond_t go;        /* condition variable for leaving */
+Runtime runtime;          /* the shared worker pool */
 int numWorkers;           /* number of workers */
-int numArrived = 0;       /* number who have arrived */
-
-/* a reusable counter barrier */
-void Barrier() {
-    pthread_mutex_lock(&barrier);
-    numArrived++;
-    if (numArrived == numWorkers) {
-        numArrived = 0;
-        pthread_cond_broadcast(&go);
-    } else
-        pthread_cond_wait(&go, &barrier);
-    pthread_mutex_unlock(&barrier);
-}
 
 /* timer */
 double read_timer() {
@@ -68,27 +57,18 @@ int minMaxValues[MAXWORKERS][MINMAX_ARRAY_SIZE]; /* partial min and max values.
 int matrix[MAXSIZE][MAXSIZE]; /* matrix */
 
 void *Worker(void *);
+void Strips(void *, long, long);
 
 /* read command line, initialize, and create threads */
 int main(int argc, char *argv[]) {
-    int i, j;
-    long l; /* use long in case of a 64-bit system */
-    pthread_attr_t attr;
-    pthread_t workerid[MAXWORKERS];
-    
-    /* set global thread attributes */
-    pthread_attr_init(&attr);
-    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
-    
-    /* initialize mutex and condition variable */
-    pthread_mutex_init(&barrier, NULL);
-    pthread_cond_init(&go, NULL);
+    int i, j, total;
     
     /* read command line args if any */
     size = (argc > 1)? atoi(argv[1]) : MAXSIZE;
     numWorkers = (argc > 2)? atoi(argv[2]) : MAXWORKERS;
     if (size > MAXSIZE) size = MAXSIZE;
     if (numWorkers > MAXWORKERS) numWorkers = MAXWORKERS;
+    if (numWorkers < 1) numWorkers = 1;
     stripSize = size/numWorkers;
     
     /* initialize the matrix */
@@ -109,16 +89,46 @@ int main(int argc, char *argv[]) {
     }
 #endif
     
-    /* do the parallel work: create the workers */
+    /* the main thread takes part in the parallel for, so one worker less is started */
+    runtimeStart(&runtime, numWorkers - 1);
+    
+    /* do the parallel work: one task for each strip */
     start_time = read_timer();
-    for (l = 0; l < numWorkers; l++)
-        pthread_create(&workerid[l], &attr, Worker, (void *) l);
-    pthread_exit(NULL);
+    parallelFor(&runtime, 0, numWorkers, 1, Strips, NULL);
+    
+    /* every strip is done, so the main thread computes the total */
+    total = 0;
+    int minIndex = 0;
+    int maxIndex = 0;
+    /* find the index for lowest min and highest max within the partial variables */
+    for (i = 0; i < numWorkers; i++) {
+        total += sums[i];
+        if(minMaxValues[i][MAXVAL] > minMaxValues[maxIndex][MAXVAL]) {
+            maxIndex = i;
+        }
+        if(minMaxValues[i][MINVAL] < minMaxValues[minIndex][MINVAL]) {
+            minIndex = i;
+        }
+    }
+    /* get end time */
+    end_time = read_timer();
+    /* print results */
+    printf("Maximum element value is %d at row/col position %d/%d\n", minMaxValues[maxIndex][MAXVAL], minMaxValues[maxIndex][MAXROW], minMaxValues[maxIndex][MAXCOL]);
+    printf("Minimum element value is %d at row/col position %d/%d\n", minMaxValues[minIndex][MINVAL], minMaxValues[minIndex][MINROW], minMaxValues[minIndex][MINCOL]);
+    printf("The total is %d\n", total);
+    printf("The execution time is %g sec\n", end_time - start_time);
+    runtimeStop(&runtime);
     return 0;
 }
 
-/* Each worker sums the values in one strip of the matrix.
- After a barrier, worker(0) computes and prints the total */
+/* runs the Worker of each strip in first up to last */
+void Strips(void *arg, long first, long last) {
+    for (long l = first; l < last; l++)
+        Worker((void *) l);
+}
+
+/* Each worker sums the values in one strip of the matrix
+ and saves its partial values */
 void *Worker(void *arg) {
     long myid = (long) arg;
     int val, total, i, j, first, last;
@@ -167,28 +177,5 @@ void *Worker(void *arg) {
     }
     
     sums[myid] = total;
-    Barrier();
-    if (myid == 0) {
-        total = 0;
-        int minIndex = 0;
-        int maxIndex = 0;
-        /* find the index for lowest min and highest max within the partial variables */
-        for (i = 0; i < numWorkers; i++) {
-            total += sums[i];
-            if(minMaxValues[i][MAXVAL] > minMaxValues[maxIndex][MAXVAL]) {
-                maxIndex = i;
-            }
-            if(minMaxValues[i][MINVAL] < minMaxValues[minIndex][MINVAL]) {
-                minIndex = i;
-            }
-        }
-        /* get end time */
-        end_time = read_timer();
-        /* print results */
-        printf("Maximum element value is %d at row/col position %d/%d\n", minMaxValues[maxIndex][MAXVAL], minMaxValues[maxIndex][MAXROW], minMaxValues[maxIndex][MAXCOL]);
-        printf("Minimum element value is %d at row/col position %d/%d\n", minMaxValues[minIndex][MINVAL], minMaxValues[minIndex][MINROW], minMaxValues[minIndex][MINCOL]);
-        printf("The total is %d\n", total);
-        printf("The execution time is %g sec\n", end_time - start_time);
-    }
     return 0;
 }
\ No newline at end of file
@@ -1,12 +1,13 @@
-/* matrix summation using pthreads
+/* matrix summation using the shared task runtime
  
  features: the workers computes and updates the
  total sum, minimum element value and maximum
- element value and the main thread prints this
- info to the standard output
+ element value, one task of a parallel for for each
+ strip, and the main thread prints this info to the
+ standard output
  
  usage under Linux:
- gcc b.c -lpthread
+ g++ b.c -lpthread
  b [size] [numWorkers]
  
  */
@@ -19,6 +20,7 @@
 #include <stdbool.h>
 #include <time.h>
 #include <sys/time.h>
+#include "../common/runtime.h"
 #define MAXSIZE 10000      /* maximum matrix size */
 #define MAXWORKERS 10   /* maximum number of workers */
 
@@ -31,8 +33,8 @@
 #define MINCOL 5
 
 pthread_mutex_t mutex;    /* mutex lock for critical calculation section */
+Runtime runtime;          /* the shared worker pool */
 int numWorkers;           /* number of workers */
-int numArrived = 0;       /* number who have arrived */
 
 /* timer */
 double read_timer() {
@@ -55,17 +57,11 @@ int minMaxValues[MINMAX_ARRAY_SIZE]; /* Storage for min and max values for the m
 int matrix[MAXSIZE][MAXSIZE]; /* matrix */
 
 void *Worker(void *);
+void Strips(void *, long, long);
 
 /* read command line, initialize, and create threads */
 int main(int argc, char *argv[]) {
     int i, j;
-    long l; /* use long in case of a 64-bit system */
-    pthread_attr_t attr;
-    pthread_t workerid[MAXWORKERS];
-    
-    /* set global thread attributes */
-    pthread_attr_init(&attr);
-    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
     
     /* initialize mutex */
     pthread_mutex_init(&mutex, NULL);
@@ -75,6 +71,7 @@ int main(int argc, char *argv[]) {
     numWorkers = (argc > 2)? atoi(argv[2]) : MAXWORKERS;
     if (size > MAXSIZE) size = MAXSIZE;
     if (numWorkers > MAXWORKERS) numWorkers = MAXWORKERS;
+    if (numWorkers < 1) numWorkers = 1;
     stripSize = size/numWorkers;
     
     /* initialize the matrix */
@@ -101,13 +98,12 @@ int main(int argc, char *argv[]) {
     /* Initiate pos of minVal and maxVal */
     minMaxValues[MAXROW] = minMaxValues[MAXCOL] = minMaxValues[MINROW] = minMaxValues[MINCOL] = 0;
     
-    /* do the parallel work: create the workers */
+    /* the main thread takes part in the parallel for, so one worker less is started */
+    runtimeStart(&runtime, numWorkers - 1);
+    
+    /* do the parallel work: one task for each strip. The parallel for returns when all are finished */
     start_time = read_timer();
-    for (l = 0; l < numWorkers; l++)
-        pthread_create(&workerid[l], &attr, Worker, (void *) l);
-    /* the main thread has to wait until the other therads are finished */
-    for (l = 0; l < numWorkers; l++)
-        pthread_join (workerid[l], NULL);
+    parallelFor(&runtime, 0, numWorkers, 1, Strips, NULL);
     
     /* get end time */
     end_time = read_timer();
@@ -116,11 +112,18 @@ int main(int argc, char *argv[]) {
     printf("Minimum element value is %d at row/col position %d/%d\n", minMaxValues[MINVAL], minMaxValues[MINROW], minMaxValues[MINCOL]);
     printf("The total is %d\n", totalSum);
     printf("The execution time is %g sec\n", end_time - start_time);
-    pthread_exit(NULL);
+    runtimeStop(&runtime);
+    return 0;
+}
+
+/* runs the Worker of each strip in first up to last */
+void Strips(void *arg, long first, long last) {
+    for (long l = first; l < last; l++)
+        Worker((void *) l);
 }
 
-/* Each worker sums the values in one strip of the matrix.
- After a barrier, worker(0) computes and prints the total */
+/* Each worker sums the values in one strip of the matrix
+ and adds its partial values to the totals */
 void *Worker(void *arg) {
     long myid = (long) arg;
     int val, i, j, first, last, subTotal;
@@ -174,8 +177,8 @@ void *Worker(void *arg) {
         minMaxValues[MAXCOL] = subMinMaxValues[MAXCOL];
     }
     
-    /* we are done updating so we release the lock before exiting the thread */
+    /* we are done updating so we release the lock before returning to the pool */
     pthread_mutex_unlock(&mutex);
     
-    pthread_exit(NULL);
+    return 0;
 }
\ No newline at end of file
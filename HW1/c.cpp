@@ -1,14 +1,20 @@
-/* matrix summation using pthreads
+/* matrix summation using the shared task runtime
  
- features: the workers computes and updates the
- total sum, minimum element value and maximum
- element value and the main thread prints this
- info to the standard output
+ features: the workers takes rows from a parallel for
+ and computes the sum, minimum element value and
+ maximum element value in their own cache line. The
+ main thread merges them and prints this info to
+ the standard output.
+ If a file is given the workers also compute the sum,
+ minimum and maximum of every row and every column in
+ the same pass and they are written to the file as
+ CSV. That pass is timed against one computing only
+ the global values
  
  
  usage under Linux:
- gcc c.c -lpthread
- c [size] [numWorkers]
+ g++ c.c -lpthread
+ c [size] [numWorkers] [grainSize] [statisticsFile]
  
  */
 #ifndef _REENTRANT
@@ -20,8 +26,12 @@
 #include <stdbool.h>
 #include <time.h>
 #include <sys/time.h>
+#include <limits.h>
+#include "../common/runtime.h"
 #define MAXSIZE 10000      /* maximum matrix size */
 #define MAXWORKERS 10   /* maximum number of workers */
+#define GRAINSIZE 1     /* standard number of rows a worker takes at a time */
+#define COLUMN_BLOCK 1024 /* columns whose partial values are kept in the cache together */
 
 #define MINMAX_ARRAY_SIZE 6 /* look at minMaxValues */
 #define MAXVAL 0
@@ -31,9 +41,24 @@
 #define MINROW 4
 #define MINCOL 5
 
-pthread_mutex_t mutex;    /* mutex lock for critical calculation section */
+/* the partial values of one worker */
+struct Partial {
+    int total;
+    int minMaxValues[MINMAX_ARRAY_SIZE];
+};
+
+/* the partial column values of one worker, allocated when the worker takes its first rows */
+struct ColumnPartial {
+    int *sum;
+    int *min;
+    int *max;
+};
+
+Runtime runtime;          /* the shared worker pool */
+Reduction<Partial> *partials; /* one Partial for each worker, on its own cache line */
+Reduction<ColumnPartial> *columnPartials = NULL; /* one ColumnPartial for each worker, with statistics */
 int numWorkers;           /* number of workers */
-int numArrived = 0;       /* number who have arrived */
+int grainSize;            /* number of rows a worker takes at a time */
 
 /* timer */
 double read_timer() {
@@ -51,32 +76,40 @@ double read_timer() {
 
 double start_time, end_time; /* start and end times */
 int size;  /* assume size is multiple of numWorkers */
-int nextRow = 0; /* shared bag for rows in the matrix */
 int totalSum; /* total sum for the matrix */
 int minMaxValues[MINMAX_ARRAY_SIZE]; /* Storage for min and max values for the matrix */
 int matrix[MAXSIZE][MAXSIZE]; /* matrix */
+int rowSum[MAXSIZE], rowMin[MAXSIZE], rowMax[MAXSIZE]; /* statistics of every row */
 
-void *Worker(void *);
+void Worker(void *, long, long);
+void mergePartial(Partial &into, const Partial &from);
+void mergeColumns(ColumnPartial &into, ColumnPartial &from);
+bool writeStatistics(FILE *file, const ColumnPartial &columns);
 
 /* read command line, initialize, and create threads */
 int main(int argc, char *argv[]) {
     int i, j;
-    long l; /* use long in case of a 64-bit system */
-    pthread_attr_t attr;
-    pthread_t workerid[MAXWORKERS];
-    
-    /* set global thread attributes */
-    pthread_attr_init(&attr);
-    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
-    
-    /* initialize mutex */
-    pthread_mutex_init(&mutex, NULL);
     
     /* read command line args if any */
     size = (argc > 1)? atoi(argv[1]) : MAXSIZE;
     numWorkers = (argc > 2)? atoi(argv[2]) : MAXWORKERS;
+    grainSize = (argc > 3)? atoi(argv[3]) : GRAINSIZE;
+    const char *statisticsFile = (argc > 4)? argv[4] : NULL;
     if (size > MAXSIZE) size = MAXSIZE;
     if (numWorkers > MAXWORKERS) numWorkers = MAXWORKERS;
+    if (numWorkers < 1) numWorkers = 1;
+    if (grainSize < 1) grainSize = 1;
+    
+    /* open the statistics file before any work, so a bad path fails at once */
+    FILE *statistics = NULL;
+    if (statisticsFile != NULL) {
+        statistics = fopen(statisticsFile, "w");
+        if (statistics == NULL) {
+            perror(statisticsFile);
+            return 1;
+        }
+    }
+    int status = 0;
     
     /* initialize the matrix */
     for (i = 0; i < size; i++) {
@@ -104,13 +137,43 @@ int main(int argc, char *argv[]) {
     /* Initiate pos of minVal and maxVal. Set pos -1  if matrix is empty */
     minMaxValues[MAXROW] = minMaxValues[MAXCOL] = minMaxValues[MINROW] = minMaxValues[MINCOL] = 0;
     
-    /* do the parallel work: create the workers */
+    /* the main thread takes part in the parallel for, so one worker less is started */
+    runtimeStart(&runtime, numWorkers - 1);
+    Partial identity;
+    identity.total = 0;
+    for (i = 0; i < MINMAX_ARRAY_SIZE; i++) {
+        identity.minMaxValues[i] = minMaxValues[i];
+    }
+    
+    /* with statistics the global values are first computed alone, as the baseline
+     the pass that also keeps the statistics is timed against */
+    double globalTime = 0;
+    if (statisticsFile != NULL) {
+        partials = new Reduction<Partial>(&runtime, identity);
+        start_time = read_timer();
+        parallelFor(&runtime, 0, size, grainSize, Worker, NULL);
+        partials->combine(mergePartial);
+        globalTime = read_timer() - start_time;
+        delete partials;
+        ColumnPartial none = {NULL, NULL, NULL};
+        columnPartials = new Reduction<ColumnPartial>(&runtime, none);
+    }
+    partials = new Reduction<Partial>(&runtime, identity);
+    
+    /* do the parallel work: the rows are handed out grainSize at a time */
     start_time = read_timer();
-    for (l = 0; l < numWorkers; l++)
-        pthread_create(&workerid[l], &attr, Worker, (void *) l);
-    /* make the main thread wait for every child thread before continuing */
-    for (l = 0; l < numWorkers; l++)
-        pthread_join (workerid[l], NULL);
+    parallelFor(&runtime, 0, size, grainSize, Worker, columnPartials);
+    
+    /* merge the partial values of all workers */
+    Partial result = partials->combine(mergePartial);
+    totalSum = result.total;
+    for (i = 0; i < MINMAX_ARRAY_SIZE; i++) {
+        minMaxValues[i] = result.minMaxValues[i];
+    }
+    ColumnPartial columns = {NULL, NULL, NULL};
+    if (columnPartials != NULL) {
+        columns = columnPartials->combine(mergeColumns);
+    }
     
     /* get end time */
     end_time = read_timer();
@@ -119,73 +182,188 @@ int main(int argc, char *argv[]) {
     printf("Minimum element value is %d at row/col position %d/%d\n", minMaxValues[MINVAL], minMaxValues[MINROW], minMaxValues[MINCOL]);
     printf("The total is %d\n", totalSum);
     printf("The execution time is %g sec\n", end_time - start_time);
-    pthread_exit(NULL);
+    delete partials;
+    
+    if (statisticsFile != NULL) {
+        double elements = (double)size * size;
+        printf("The execution time without statistics is %g sec\n", globalTime);
+        if (globalTime > 0 && end_time - start_time > 0) {
+            printf("The throughput is %g elements/sec for the global values alone and %g elements/sec for the global values with the row and column statistics\n", elements / globalTime, elements / (end_time - start_time));
+        }
+        if (writeStatistics(statistics, columns)) {
+            printf("The row and column statistics are written to %s\n", statisticsFile);
+        } else {
+            perror(statisticsFile);
+            status = 1;
+        }
+        for (i = 0; i < columnPartials->nrSlots; i++) {
+            delete[] columnPartials->slots[i].value.sum;
+            delete[] columnPartials->slots[i].value.min;
+            delete[] columnPartials->slots[i].value.max;
+        }
+        delete columnPartials;
+    }
+    runtimeStop(&runtime);
+    return status;
 }
 
-/* Each worker sums the values in one strip of the matrix.
- After a barrier, worker(0) computes and prints the total */
-void *Worker(void *arg) {
-    long myid = (long) arg;
-    int val, i, j;
-    
-#ifdef DEBUG
-    printf("worker %d (pthread id %d) has started\n", myid, pthread_self());
-#endif
+/* merges the partial values from into into. On equal values the position that comes first in the
+ matrix is kept, so the result does not depend on which worker took which rows */
+void mergePartial(Partial &into, const Partial &from) {
+    into.total += from.total;
+    if(from.minMaxValues[MINVAL] < into.minMaxValues[MINVAL]
+       || (from.minMaxValues[MINVAL] == into.minMaxValues[MINVAL]
+           && (from.minMaxValues[MINROW] < into.minMaxValues[MINROW]
+               || (from.minMaxValues[MINROW] == into.minMaxValues[MINROW] && from.minMaxValues[MINCOL] < into.minMaxValues[MINCOL])))) {
+        into.minMaxValues[MINVAL] = from.minMaxValues[MINVAL];
+        into.minMaxValues[MINROW] = from.minMaxValues[MINROW];
+        into.minMaxValues[MINCOL] = from.minMaxValues[MINCOL];
+    }
+    if(from.minMaxValues[MAXVAL] > into.minMaxValues[MAXVAL]
+       || (from.minMaxValues[MAXVAL] == into.minMaxValues[MAXVAL]
+           && (from.minMaxValues[MAXROW] < into.minMaxValues[MAXROW]
+               || (from.minMaxValues[MAXROW] == into.minMaxValues[MAXROW] && from.minMaxValues[MAXCOL] < into.minMaxValues[MAXCOL])))) {
+        into.minMaxValues[MAXVAL] = from.minMaxValues[MAXVAL];
+        into.minMaxValues[MAXROW] = from.minMaxValues[MAXROW];
+        into.minMaxValues[MAXCOL] = from.minMaxValues[MAXCOL];
+    }
+}
+
+/* Each worker sums the values in the rows first up to last of the matrix
+ and merges them into the partial values of its thread. Given the column
+ partials in arg it also keeps the sum, minimum and maximum of every row
+ and adds the rows into the column values of its thread in the same pass */
+void Worker(void *arg, long first, long last) {
+    int val, i, j, block, blockEnd;
+    Reduction<ColumnPartial> *columnValues = (Reduction<ColumnPartial> *)arg;
     
-    int subMinMaxValues[MINMAX_ARRAY_SIZE];
+    Partial sub;
+    int *subMinMaxValues = sub.minMaxValues;
     
-    /* Initiating min and max values to the first value in the matrix. */
-    subMinMaxValues[MAXVAL] = subMinMaxValues[MINVAL] = matrix[0][0];
+    /* Initiating min and max values to the first value in the rows. */
+    subMinMaxValues[MAXVAL] = subMinMaxValues[MINVAL] = matrix[first][0];
     
     /* Initiate pos of minVal and maxVal */
-    subMinMaxValues[MAXROW] = subMinMaxValues[MINROW] = subMinMaxValues[MAXCOL] = subMinMaxValues[MINCOL] = 0;
+    subMinMaxValues[MAXROW] = subMinMaxValues[MINROW] = first;
+    subMinMaxValues[MAXCOL] = subMinMaxValues[MINCOL] = 0;
     
     int subTotal = 0;
     
-    while(true) {
-        /* make sure to lock the thread before updating */
-        pthread_mutex_lock(&mutex);
-        /* take a new row from the "bag" */
-        i = nextRow++;
-        pthread_mutex_unlock(&mutex);
-        if(i >= size) {
-            /* make sure to abort if we passed the last row */
-            break;
+    if (columnValues == NULL) {
+        for (i = first; i < last; i++) {
+            for (j = 0; j < size; j++) {
+                val = matrix[i][j];
+                subTotal += val;
+                /* Update the min, max and pos. Note that can use if-else like this
+                 since we initiate minVal and maxVal to the same value, there for
+                 both if-statements can never be true at the same time */
+                if(val < subMinMaxValues[MINVAL]) {
+                    subMinMaxValues[MINVAL] = val;
+                    subMinMaxValues[MINROW] = i;
+                    subMinMaxValues[MINCOL] = j;
+                } else if(val > subMinMaxValues[MAXVAL]) {
+                    subMinMaxValues[MAXVAL] = val;
+                    subMinMaxValues[MAXROW] = i;
+                    subMinMaxValues[MAXCOL] = j;
+                }
+            }
+        }
+    } else {
+        ColumnPartial &columns = columnValues->local();
+        if (columns.sum == NULL) {
+            columns.sum = new int[size];
+            columns.min = new int[size];
+            columns.max = new int[size];
+            for (j = 0; j < size; j++) {
+                columns.sum[j] = 0;
+                columns.min[j] = INT_MAX;
+                columns.max[j] = INT_MIN;
+            }
         }
+        int *columnSum = columns.sum;
+        int *columnMin = columns.min;
+        int *columnMax = columns.max;
         
-        for (j = 0; j < size; j++) {
-            val = matrix[i][j];
-            subTotal += val;
-            /* Update the min, max and pos. Note that can use if-else like this
-             since we initiate minVal and maxVal to the same value, there for
-             both if-statements can never be true at the same time */
-            if(val < subMinMaxValues[MINVAL]) {
-                subMinMaxValues[MINVAL] = val;
-                subMinMaxValues[MINROW] = i;
-                subMinMaxValues[MINCOL] = j;
-            } else if(val > subMinMaxValues[MAXVAL]) {
-                subMinMaxValues[MAXVAL] = val;
-                subMinMaxValues[MAXROW] = i;
-                subMinMaxValues[MAXCOL] = j;
+        for (i = first; i < last; i++) {
+            rowSum[i] = 0;
+            rowMin[i] = INT_MAX;
+            rowMax[i] = INT_MIN;
+        }
+        
+        /* The rows are walked one block of columns at a time, so the column values of a block
+         stay in the cache for all the rows of the chunk. The inner loop has no branches and
+         compiles to vector instructions, so the position of a new min or max is looked up
+         afterwards in the part of the row that has it. Blocks are visited in order, so a value
+         equal to the current one only moves the position when it is in an earlier row */
+        for (block = 0; block < size; block += COLUMN_BLOCK) {
+            blockEnd = (block + COLUMN_BLOCK < size) ? block + COLUMN_BLOCK : size;
+            for (i = first; i < last; i++) {
+                const int *row = matrix[i];
+                int sum = 0, min = INT_MAX, max = INT_MIN;
+                for (j = block; j < blockEnd; j++) {
+                    val = row[j];
+                    sum += val;
+                    min = (val < min) ? val : min;
+                    max = (val > max) ? val : max;
+                    columnSum[j] += val;
+                    columnMin[j] = (val < columnMin[j]) ? val : columnMin[j];
+                    columnMax[j] = (val > columnMax[j]) ? val : columnMax[j];
+                }
+                subTotal += sum;
+                rowSum[i] += sum;
+                rowMin[i] = (min < rowMin[i]) ? min : rowMin[i];
+                rowMax[i] = (max > rowMax[i]) ? max : rowMax[i];
+                if(min < subMinMaxValues[MINVAL] || (min == subMinMaxValues[MINVAL] && i < subMinMaxValues[MINROW])) {
+                    for (j = block; row[j] != min; j++);
+                    subMinMaxValues[MINVAL] = min;
+                    subMinMaxValues[MINROW] = i;
+                    subMinMaxValues[MINCOL] = j;
+                }
+                if(max > subMinMaxValues[MAXVAL] || (max == subMinMaxValues[MAXVAL] && i < subMinMaxValues[MAXROW])) {
+                    for (j = block; row[j] != max; j++);
+                    subMinMaxValues[MAXVAL] = max;
+                    subMinMaxValues[MAXROW] = i;
+                    subMinMaxValues[MAXCOL] = j;
+                }
             }
         }
     }
     
-    /* we lock here since we now have to update the global variables with this threads results */
-    pthread_mutex_lock(&mutex);
-    totalSum += subTotal;
-    if(subMinMaxValues[MINVAL] < minMaxValues[MINVAL]) {
-        minMaxValues[MINVAL] = subMinMaxValues[MINVAL];
-        minMaxValues[MINROW] = subMinMaxValues[MINROW];
-        minMaxValues[MINCOL] = subMinMaxValues[MINCOL];
+    /* no lock is needed, the partial values of this thread are only used by this thread until the end */
+    sub.total = subTotal;
+    mergePartial(partials->local(), sub);
+}
+
+/* adds the column values of from into into, a worker that took no rows has no values. If into has
+ no values it takes over the ones of from, so every array is still owned by a single worker */
+void mergeColumns(ColumnPartial &into, ColumnPartial &from) {
+    int j;
+    if (from.sum == NULL) {
+        return;
     }
-    if(subMinMaxValues[MAXVAL] > minMaxValues[MAXVAL]) {
-        minMaxValues[MAXVAL] = subMinMaxValues[MAXVAL];
-        minMaxValues[MAXROW] = subMinMaxValues[MAXROW];
-        minMaxValues[MAXCOL] = subMinMaxValues[MAXCOL];
+    if (into.sum == NULL) {
+        into = from;
+        from.sum = from.min = from.max = NULL;
+        return;
     }
-    
-    /* we are done updating so we release the lock before exiting the thread */
-    pthread_mutex_unlock(&mutex);
-    pthread_exit(NULL);
+    for (j = 0; j < size; j++) {
+        into.sum[j] += from.sum[j];
+        into.min[j] = (from.min[j] < into.min[j]) ? from.min[j] : into.min[j];
+        into.max[j] = (from.max[j] > into.max[j]) ? from.max[j] : into.max[j];
+    }
+}
+
+/* writes one line "row,index,sum,min,max" for every row and "column,index,sum,min,max" for every column
+ to the opened file and closes it */
+bool writeStatistics(FILE *file, const ColumnPartial &columns) {
+    int i;
+    fprintf(file, "kind,index,sum,min,max\n");
+    for (i = 0; i < size; i++) {
+        fprintf(file, "row,%d,%d,%d,%d\n", i, rowSum[i], rowMin[i], rowMax[i]);
+    }
+    for (i = 0; i < size && columns.sum != NULL; i++) {
+        fprintf(file, "column,%d,%d,%d,%d\n", i, columns.sum[i], columns.min[i], columns.max[i]);
+    }
+    bool failed = ferror(file) != 0;
+    return fclose(file) == 0 && !failed;
 }
\ No newline at end of file
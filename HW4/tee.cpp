@@ -1,11 +1,19 @@
 /*
  features: reads from standard input and prints
  to standard output and to the given file. Exits
- if the word 'exit' is written.
+ if the word 'exit' is written or the input ends.
+ The writers are tasks of the shared runtime and
+ sleep while there are no new lines.
+ With -m many input streams are copied at once by
+ one thread with an epoll event loop. Every source
+ is copied line by line to its own sinks, where a
+ line is always written whole. A stream pauses
+ while one of its sinks can not keep up.
  
  usage under Linux:
- g++ tee.cpp -o tee
+ g++ tee.cpp -o tee -lpthread
  tee file
+ tee -m source=sink[,sink...] [source=sink[,sink...] ...]
  
  */
 #ifndef _REENTRANT
@@ -18,37 +26,56 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <string.h>
+#include "../common/runtime.h"
+#ifdef __linux__
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
 
 #define EXIT    "exit"
 #define INDEX_STDOUT 0
 #define INDEX_FILEOUT 1
+#define NOTIFY_BATCH 1024 /* the writers are woken at least once every this many lines */
+#define READ_SIZE 65536   /* bytes a stream reads at a time, so a busy stream can not starve the others */
+#define SINK_HIGH_WATER (1 << 20) /* a stream pauses while one of its sinks has this many bytes unwritten */
+#define MAX_EVENTS 256    /* events taken from epoll at a time */
+#define CONNECT_RETRY 100 /* milliseconds between the tries to open a named pipe sink that has no reader */
+#define SOCKET_PREFIX "unix:" /* a source or sink with this prefix is a Unix socket */
 
 pthread_mutex_t mutex;    /* mutex lock for critical calculation section */
+Runtime runtime;          /* the shared worker pool running the writers */
+EventCount newLines;      /* the writers sleep here until new lines come */
 
 std::vector<std::string> inputLines;
 int writes[2] = {0}; /* counter for writes for both the file and standard output */
-void *Writer(void *);
+void Writer(void *, long);
+int copyStreams(int count, char *specs[]);
 
 /* read command line, initialize, and create threads */
 int main(int argc, char *argv[]) {
     int min;
+    int unannounced = 0; /* lines added since the writers were last woken */
     std::string line;
     std::string command;
-    
-    pthread_attr_t attr;
-    pthread_t outWriter;
-    pthread_t fileWriter;
-    
-    /* set global thread attributes */
-    pthread_attr_init(&attr);
-    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+    TaskGroup writers;
     
     /* initialize mutex */
     pthread_mutex_init(&mutex, NULL);
     
     /* read command line args */
+    if(argc > 2 && strcmp(argv[1], "-m") == 0) {
+        exit(copyStreams(argc - 2, argv + 2));
+    }
     if(argc != 2) {
-        fprintf(stderr, "Usage: tee FILENAME\n");
+        fprintf(stderr, "Usage: tee FILENAME\n       tee -m SOURCE=SINK[,SINK...] ...\n");
         exit(1);
     }
     
@@ -60,12 +87,20 @@ int main(int argc, char *argv[]) {
     }
     
     /* start the writer for standard output and for the file*/
-    pthread_create(&fileWriter, &attr, Writer, f);
-    pthread_create(&outWriter, &attr, Writer, stdout);
+    runtimeStart(&runtime, 2);
+    taskGroupInit(&writers);
+    runtimeSubmit(&runtime, &writers, Writer, f, INDEX_FILEOUT);
+    runtimeSubmit(&runtime, &writers, Writer, stdout, INDEX_STDOUT);
+    
+    /* buffer the standard input, so we can tell when the next line would have to wait for input */
+    std::ios::sync_with_stdio(false);
     
     /* the main thread handles the standard input */
     while(true){
-        std::getline(std::cin,line);
+        if(!std::getline(std::cin,line)) {
+            /* the input has ended, so we stop as if exit was written */
+            line = EXIT;
+        }
         /* when new input comes, make sure to lock since we are both adding the
          new line and also erasing old lines */
         pthread_mutex_lock(&mutex);
@@ -73,6 +108,7 @@ int main(int argc, char *argv[]) {
         if(line == EXIT) {
             /* we exit if the exit command has been written */
             pthread_mutex_unlock(&mutex);
+            eventNotify(&newLines, true);
             break;
         }
         
@@ -83,46 +119,499 @@ int main(int argc, char *argv[]) {
             writes[INDEX_FILEOUT] -= min;
             inputLines.erase(inputLines.begin(), inputLines.begin() + min);
         }
-        /* unlock to let the writers write */
+        /* unlock to let the writers write. They are only woken when no more input is buffered
+         or enough lines are waiting, so a fast producer does not pay for a wakeup per line */
         pthread_mutex_unlock(&mutex);
+        if(++unannounced >= NOTIFY_BATCH || std::cin.rdbuf()->in_avail() <= 0) {
+            unannounced = 0;
+            eventNotify(&newLines, true);
+        }
     }
     /* make sure that the writers are finished before exiting */
-    pthread_join(outWriter, NULL);
-    pthread_join(fileWriter, NULL);
+    taskGroupWait(&runtime, &writers);
+    runtimeStop(&runtime);
     exit(0);
 }
 
 /* a writer writes to some file. The file can represent the standard output but does not have to */
-void *Writer(void *arg) {
-    int index;
-    if(arg == stdout) {
-        index = INDEX_STDOUT;
-    } else {
-        index = INDEX_FILEOUT;
-    }
+void Writer(void *arg, long index) {
     FILE* f = (FILE*) arg;
-    std::string line;
-    while(true) {
+    std::vector<std::string> lines;
+    bool done = false;
+    while(!done) {
+        /* announce that we might sleep before looking, so a line added after the look wakes us */
+        int key = eventPrepare(&newLines);
         /* make sure to lock since the reader might alter the inputLines */
         pthread_mutex_lock(&mutex);
         if(writes[index] < inputLines.size()) {
-            /* take the next line and increase the fileWrites index */
-            line = inputLines[writes[index]];
-            writes[index]++;
+            /* take all the new lines and increase the writes index */
+            lines.assign(inputLines.begin() + writes[index], inputLines.end());
+            writes[index] = inputLines.size();
             pthread_mutex_unlock(&mutex);
-            if(line == EXIT) {
-                /* exit if the exit command was written */
-                break;
+            eventCancel(&newLines);
+            for(size_t i = 0; i < lines.size(); i++) {
+                if(lines[i] == EXIT) {
+                    /* exit if the exit command was written */
+                    done = true;
+                    break;
+                }
+                fprintf(f, "%s", lines[i].c_str());
             }
-            fprintf(f, "%s", line.c_str());
         } else {
-            /* no new lines so we can unlock and yield our time */
+            /* no new lines so we can unlock and sleep until the reader adds more */
             pthread_mutex_unlock(&mutex);
-            pthread_yield_np();
+            eventWait(&newLines, key);
         }
         
     }
-    /* make sure to close the file before the thread exits */
+    /* make sure to close the file before the task ends */
     fclose(f);
-    pthread_exit(NULL);
-}
\ No newline at end of file
+}
+
+#ifdef __linux__
+#define TYPE_STREAM 0
+#define TYPE_SINK 1
+#define TYPE_LISTENER 2
+#define TYPE_SIGNAL 3
+
+/* something the event loop waits on, the epoll events point to it */
+struct Endpoint {
+    int type;
+    int fd;
+    bool polled;    /* regular files can not be polled, they are always ready */
+    int savedFlags; /* the file status flags to restore on standard input and output */
+};
+
+/* an output shared by all sources that name it. The buffer only ever gets whole lines */
+struct Sink : Endpoint {
+    std::string path;
+    std::string buffer;
+    size_t written;   /* bytes at the start of buffer that are written already */
+    bool connected;   /* a named pipe without a reader has no fd yet, its lines wait in the buffer */
+    bool failed;
+};
+
+/* one input, copied line by line to its sinks */
+struct Stream : Endpoint {
+    std::string name;
+    std::vector<Sink *> sinks;
+    std::string pending; /* bytes read after the last complete line */
+    bool readable;       /* there might be more to read without waiting */
+    bool closed;
+};
+
+/* a Unix socket, every connection to it becomes a stream with the sinks of the socket */
+struct Listener : Endpoint {
+    std::string path;
+    std::vector<Sink *> sinks;
+};
+
+int epollFd;
+std::vector<Stream *> streams;
+std::vector<Sink *> sinks;
+std::vector<Listener *> listeners;
+char readBuffer[READ_SIZE];
+int stopSignals = 0; /* SIGINT and SIGTERM received */
+int status = 0;      /* exit status, 1 after any error */
+
+/* makes fd non-blocking and lets epoll report events on it */
+void watch(Endpoint *endpoint, int type, int fd, uint32_t events) {
+    struct epoll_event event;
+    endpoint->type = type;
+    endpoint->fd = fd;
+    endpoint->savedFlags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, endpoint->savedFlags | O_NONBLOCK);
+    event.events = events;
+    event.data.ptr = endpoint;
+    endpoint->polled = epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+/* closes fd, standard input and output are left open with their flags restored */
+void unwatch(Endpoint *endpoint) {
+    if(endpoint->fd <= STDERR_FILENO) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, endpoint->fd, NULL);
+        fcntl(endpoint->fd, F_SETFL, endpoint->savedFlags);
+    } else {
+        close(endpoint->fd);
+    }
+}
+
+bool socketAddress(const char *path, struct sockaddr_un *address) {
+    if(strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "tee: socket path is too long: %s\n", path);
+        return false;
+    }
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+/* opens a sink, a path that is already open gives the same sink */
+Sink *openSink(const char *path) {
+    struct sockaddr_un address;
+    int fd;
+    for(size_t i = 0; i < sinks.size(); i++) {
+        if(sinks[i]->path == path) {
+            return sinks[i];
+        }
+    }
+    if(strcmp(path, "-") == 0) {
+        fd = STDOUT_FILENO;
+    } else if(strncmp(path, SOCKET_PREFIX, strlen(SOCKET_PREFIX)) == 0) {
+        if(!socketAddress(path + strlen(SOCKET_PREFIX), &address)) {
+            return NULL;
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK | O_CLOEXEC, 0644);
+    }
+    /* a named pipe without a reader can not be opened without blocking, the event loop tries again */
+    if(fd < 0 && errno != ENXIO) {
+        perror(path);
+        return NULL;
+    }
+    Sink *sink = new Sink();
+    sink->path = path;
+    sink->written = 0;
+    sink->failed = false;
+    sink->connected = fd >= 0;
+    sink->type = TYPE_SINK;
+    sink->fd = -1;
+    if(sink->connected) {
+        watch(sink, TYPE_SINK, fd, EPOLLOUT | EPOLLET);
+    }
+    sinks.push_back(sink);
+    return sink;
+}
+
+/* tries to open a named pipe sink again, it stays unconnected until the pipe has a reader */
+void connectSink(Sink *sink) {
+    int fd = open(sink->path.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if(fd >= 0) {
+        watch(sink, TYPE_SINK, fd, EPOLLOUT | EPOLLET);
+        sink->connected = true;
+    } else if(errno != ENXIO && errno != EINTR) {
+        perror(sink->path.c_str());
+        status = 1;
+        sink->failed = true;
+    }
+}
+
+void addStream(int fd, const std::string &name, const std::vector<Sink *> &streamSinks) {
+    Stream *stream = new Stream();
+    stream->name = name;
+    stream->sinks = streamSinks;
+    stream->closed = false;
+    watch(stream, TYPE_STREAM, fd, EPOLLIN | EPOLLRDHUP | EPOLLET);
+    /* a named pipe reads as ended until its first writer comes, so a polled stream waits for its first
+     event. epoll reports one right away if there is input already */
+    stream->readable = !stream->polled;
+    streams.push_back(stream);
+}
+
+/* opens standard input, a file, a named pipe or a listening Unix socket */
+bool openSource(const char *path, const std::vector<Sink *> &sourceSinks) {
+    struct sockaddr_un address;
+    struct stat info;
+    if(strcmp(path, "-") == 0) {
+        addStream(STDIN_FILENO, "standard input", sourceSinks);
+        return true;
+    }
+    if(strncmp(path, SOCKET_PREFIX, strlen(SOCKET_PREFIX)) != 0) {
+        /* a named pipe opens right away, and reads nothing until a writer opens it */
+        int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if(fd < 0) {
+            perror(path);
+            return false;
+        }
+        addStream(fd, path, sourceSinks);
+        return true;
+    }
+    path += strlen(SOCKET_PREFIX);
+    if(!socketAddress(path, &address)) {
+        return false;
+    }
+    /* a socket left behind by an earlier run is replaced */
+    if(lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror(path);
+        if(fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    Listener *listener = new Listener();
+    listener->path = path;
+    listener->sinks = sourceSinks;
+    watch(listener, TYPE_LISTENER, fd, EPOLLIN);
+    listeners.push_back(listener);
+    return true;
+}
+
+/* a spec is SOURCE=SINK[,SINK...] */
+bool openSpec(char *spec) {
+    std::vector<Sink *> specSinks;
+    char *equals = strchr(spec, '=');
+    if(equals == NULL || equals == spec || equals[1] == '\0') {
+        fprintf(stderr, "tee: expected SOURCE=SINK[,SINK...] but got %s\n", spec);
+        return false;
+    }
+    *equals = '\0';
+    for(char *path = strtok(equals + 1, ","); path != NULL; path = strtok(NULL, ",")) {
+        Sink *sink = openSink(path);
+        if(sink == NULL) {
+            return false;
+        }
+        specSinks.push_back(sink);
+    }
+    return openSource(spec, specSinks);
+}
+
+/* appends whole lines to every sink of the stream. The event loop is the only thread adding to the
+ buffers, so lines of different streams never mix inside a shared sink */
+void appendLines(Stream *stream, const char *data, size_t size) {
+    for(size_t i = 0; i < stream->sinks.size(); i++) {
+        if(!stream->sinks[i]->failed) {
+            stream->sinks[i]->buffer.append(data, size);
+        }
+    }
+}
+
+/* a last line without a newline gets one, so the next line in a shared sink starts on its own */
+void closeStream(Stream *stream) {
+    if(!stream->pending.empty()) {
+        stream->pending.push_back('\n');
+        appendLines(stream, stream->pending.data(), stream->pending.size());
+        stream->pending.clear();
+    }
+    unwatch(stream);
+    stream->closed = true;
+}
+
+void closeListener(Listener *listener) {
+    unwatch(listener);
+    unlink(listener->path.c_str());
+    delete listener;
+}
+
+/* a stream waits while one of its sinks is behind */
+bool sinksFull(Stream *stream) {
+    for(size_t i = 0; i < stream->sinks.size(); i++) {
+        Sink *sink = stream->sinks[i];
+        if(!sink->failed && sink->buffer.size() - sink->written >= SINK_HIGH_WATER) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* reads once from the stream and hands its complete lines to the sinks. A line 'exit' ends the stream */
+void readStream(Stream *stream) {
+    ssize_t n = read(stream->fd, readBuffer, READ_SIZE);
+    if(n < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            stream->readable = false;
+        } else if(errno != EINTR) {
+            perror(stream->name.c_str());
+            status = 1;
+            closeStream(stream);
+        }
+        return;
+    }
+    if(n == 0) {
+        closeStream(stream);
+        return;
+    }
+    size_t position = stream->pending.size(); /* the bytes before have no newline */
+    stream->pending.append(readBuffer, n);
+    const char *data = stream->pending.data();
+    size_t size = stream->pending.size();
+    size_t start = 0;
+    const char *newline;
+    while((newline = (const char *)memchr(data + position, '\n', size - position)) != NULL) {
+        size_t end = newline - data;
+        if(end - start == strlen(EXIT) && memcmp(data + start, EXIT, end - start) == 0) {
+            appendLines(stream, data, start);
+            stream->pending.clear();
+            closeStream(stream);
+            return;
+        }
+        start = position = end + 1;
+    }
+    appendLines(stream, data, start);
+    stream->pending.erase(0, start);
+}
+
+/* writes as much of the sink as it takes, the rest waits until epoll reports room or the
+ named pipe gets a reader */
+void flushSink(Sink *sink) {
+    if(!sink->failed && !sink->connected) {
+        connectSink(sink);
+        if(!sink->connected && !sink->failed) {
+            return;
+        }
+    }
+    while(!sink->failed && sink->written < sink->buffer.size()) {
+        ssize_t n = write(sink->fd, sink->buffer.data() + sink->written, sink->buffer.size() - sink->written);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* drop the written part once it is the larger part, so the buffer does not only grow */
+                if(sink->written >= sink->buffer.size() / 2) {
+                    sink->buffer.erase(0, sink->written);
+                    sink->written = 0;
+                }
+                return;
+            }
+            perror(sink->path.c_str());
+            status = 1;
+            sink->failed = true;
+        } else {
+            sink->written += n;
+        }
+    }
+    sink->buffer.clear();
+    sink->written = 0;
+}
+
+/* SIGINT or SIGTERM stops reading and lets the sinks write what they have, a second one drops that too */
+void stop() {
+    for(size_t i = 0; i < listeners.size(); i++) {
+        closeListener(listeners[i]);
+    }
+    listeners.clear();
+    for(size_t i = 0; i < streams.size(); i++) {
+        if(!streams[i]->closed) {
+            closeStream(streams[i]);
+        }
+    }
+    if(stopSignals > 1) {
+        for(size_t i = 0; i < sinks.size(); i++) {
+            sinks[i]->failed = true;
+        }
+    }
+}
+
+/* accepts every waiting connection as a new stream */
+void acceptConnections(Listener *listener) {
+    while(true) {
+        int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror(listener->path.c_str());
+            }
+            return;
+        }
+        addStream(fd, listener->path, listener->sinks);
+    }
+}
+
+/* the event loop of -m: every round each ready stream with room in its sinks reads once, then the
+ sinks are written, then epoll is asked for more, without waiting if a stream still has input */
+int copyStreams(int count, char *specs[]) {
+    struct epoll_event events[MAX_EVENTS];
+    sigset_t signals;
+    Endpoint signalEndpoint;
+    
+    /* a sink that went away is reported by write */
+    signal(SIGPIPE, SIG_IGN);
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    for(int i = 0; i < count; i++) {
+        if(!openSpec(specs[i])) {
+            return 1;
+        }
+    }
+    
+    /* SIGINT and SIGTERM are read from a signalfd so the loop can stop between two lines. They are
+     only blocked once every spec is open, so a slow open can still be interrupted */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    watch(&signalEndpoint, TYPE_SIGNAL, signalfd(-1, &signals, SFD_CLOEXEC), EPOLLIN);
+    
+    while(true) {
+        bool ready = false;
+        bool connecting = false;
+        for(size_t i = 0; i < streams.size(); i++) {
+            if(streams[i]->readable && !streams[i]->closed && !sinksFull(streams[i])) {
+                readStream(streams[i]);
+            }
+        }
+        
+        /* no epoll event can point to a closed stream anymore, they were all handled */
+        size_t open = 0;
+        for(size_t i = 0; i < streams.size(); i++) {
+            if(streams[i]->closed) {
+                delete streams[i];
+            } else {
+                streams[open++] = streams[i];
+            }
+        }
+        streams.resize(open);
+        
+        bool unwritten = false;
+        for(size_t i = 0; i < sinks.size(); i++) {
+            flushSink(sinks[i]);
+            unwritten = unwritten || sinks[i]->written < sinks[i]->buffer.size();
+            connecting = connecting || (!sinks[i]->connected && !sinks[i]->failed);
+        }
+        if(streams.empty() && listeners.empty() && !unwritten) {
+            break;
+        }
+        for(size_t i = 0; i < streams.size(); i++) {
+            ready = ready || (streams[i]->readable && !sinksFull(streams[i]));
+        }
+        
+        /* no event tells when a named pipe gets a reader, so an unconnected sink is tried again later */
+        int n = epoll_wait(epollFd, events, MAX_EVENTS, ready ? 0 : (connecting ? CONNECT_RETRY : -1));
+        int signalsBefore = stopSignals;
+        for(int i = 0; i < n; i++) {
+            Endpoint *endpoint = (Endpoint *)events[i].data.ptr;
+            if(endpoint->type == TYPE_STREAM) {
+                ((Stream *)endpoint)->readable = true;
+            } else if(endpoint->type == TYPE_LISTENER) {
+                acceptConnections((Listener *)endpoint);
+            } else if(endpoint->type == TYPE_SIGNAL) {
+                struct signalfd_siginfo info;
+                while(read(endpoint->fd, &info, sizeof(info)) == sizeof(info)) {
+                    stopSignals++;
+                }
+            }
+            /* a sink with room is written in the next round anyway */
+        }
+        /* only after the events, since they might point to the listeners stop closes */
+        if(stopSignals > signalsBefore) {
+            stop();
+        }
+    }
+    
+    for(size_t i = 0; i < sinks.size(); i++) {
+        if(sinks[i]->connected) {
+            unwatch(sinks[i]);
+        }
+        delete sinks[i];
+    }
+    close(signalEndpoint.fd);
+    close(epollFd);
+    return status;
+}
+#else
+int copyStreams(int count, char *specs[]) {
+    fprintf(stderr, "tee: -m needs epoll, which only Linux has\n");
+    return 1;
+}
+#endif
\ No newline at end of file
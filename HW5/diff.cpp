@@ -1,12 +1,26 @@
 /* compare commands for 2 files using pthreads
  
- features: 2 workers reads each file. Then a set amount
- of workers compares the lines and the main thread prints
- the line if they are equal.
+ features: a set amount of readers reads byte ranges of
+ both files at the same time with pread. Then a set amount
+ of workers compares both files in large blocks and counts
+ the newlines of the identical blocks. Only the differing
+ blocks, widened to whole lines, are split into lines.
+ The comparers compares those lines in slices and publishes
+ each finished slice. The main thread commits the slices
+ in order and prints the lines that differ, formatting
+ many slices into one buffer per write(2).
+ 
+ given 2 directories, 2 workers walks each tree and the
+ files are matched by their path. Pairs that are not
+ cheaply known to be identical are diffed on the
+ work-stealing pool and printed in path order.
+ 
+ all the workers are tasks of the shared runtime.
  
  usage under Linux:
  g++ diff.c -lpthread
- diff FILE FILE
+ diff [-j WORKERS] [-r READERS] FILE FILE
+ diff [-c] [-j WORKERS] DIRECTORY DIRECTORY
  
  */
 #ifndef _REENTRANT
@@ -16,137 +30,790 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <string>
 #include <iostream>
 #include <vector>
-#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "../common/runtime.h"
 
-#define NR_COMPARERS 10 /* number of threads comparing lines */
+#define NR_COMPARERS 10 /* number of tasks comparing lines, also the least number of workers in the pool */
 #define UNCHECKED    0  /* represents an unchecked line */
 #define EQUAL        1  /* represents a line that is equal */
 #define UNEQUAL      2  /* represnets a line that is unequal */
+#define OUTPUT_BUFFER_SIZE (1 << 20) /* the printer flushes its buffer once it grows past this many bytes */
+#define BLOCK_SIZE (1 << 20) /* how many bytes a scanner compares in one take */
+#define SCAN_GRAIN 8 /* how many blocks a pool task scans, bigger files are split into several tasks */
+#define NR_READERS 4   /* standard number of threads reading each file */
+#define MAX_READERS 64 /* maximum number of threads reading each file */
+#define MIN_READ_CHUNK (1 << 20) /* files are not split into byte ranges smaller than this */
+
+/* a line is a view into the data of its file, excluding the newline */
+struct Line {
+    const char *start;
+    long length;
+};
+
+/* everything known about two files being compared */
+struct FilePair {
+    std::string path;                /* the path relative to the compared directories */
+    int files[2];                    /* file descriptors for both the files */
+    char *fileData[2];               /* the whole content of both files */
+    long fileSizes[2];               /* the size in bytes of both files */
+    long minSize;                    /* the size in bytes of the smallest file */
+    long nrBlocks;                   /* number of blocks covering the first minSize bytes */
+    std::vector<char> blockSame;     /* true for a block whose bytes are identical in both files */
+    std::vector<long> blockNewlines; /* number of newlines in a block, only counted for identical blocks */
+    std::vector<Line> fileLines[2];  /* holder for the lines of the differing regions of both files */
+    std::vector<long> lineNumbers;   /* the line number in the files for each line in fileLines */
+    std::atomic<long> chunksLeft;    /* scan tasks of this pair that are not finished yet */
+    std::atomic<bool> done;          /* set (release) by the pool when output holds the result */
+    std::string output;              /* the formatted differences, only used for directories */
+};
+
+/* a byte range of a file for one reader, a range starting at -1 means the whole file is read sequentially */
+struct ReadChunk {
+    long fileIndex;
+    long start;
+    long end;
+    bool last;     /* the last range keeps reading past end until the end of the file */
+    char *tail;    /* what the last range read past end, appended once all readers are done */
+    long tailSize;
+};
 
-pthread_mutex_t mutex;  /* mutex lock for critical calculation section */
+/* a file found while walking a directory tree */
+struct Entry {
+    std::string path; /* the path relative to the root of the tree */
+    long size;
+    struct timespec modified;
+    dev_t device;
+    ino_t inode;
+};
 
-std::vector<std::string> fileLines[2]; /* holder for lines for both files */
-std::ifstream files[2];                /* holder for both the files */
-std::vector<int> lineStatus;           /* the current status for a line, can be UNCHECKED, EQUAL or UNEQUAL */
+Runtime runtime;        /* the worker pool running all tasks */
+EventCount published;   /* the main thread sleeps here until a slice or a directory file pair is published */
+
+FilePair filePair;   /* the 2 files compared when not comparing directories */
+int nrReaders = NR_READERS; /* number of tasks reading each file */
+int nrWorkers = 0;          /* threads of the pool, 0 sizes it from the comparers and readers */
+
+std::vector<char> lineStatus;   /* the status for a line, can be UNCHECKED, EQUAL or UNEQUAL */
+std::atomic<bool> *sliceDone;   /* set (release) by a comparer when all lines of its slice have a status */
 
 long minLines;       /* will contain the minimum size of lines in regards to both files */
-long nextLine = 0;   /* acts as a "bag". A comparer taking new lines begins at this point */
-long slizeSize = 10; /* how many lines each comparer takes in one take */
+std::atomic<long> nextLine(0); /* acts as a "bag". A comparer taking new lines begins at this point */
+long slizeSize = 1024; /* how many lines each comparer takes in one take */
+
+std::string roots[2];              /* the 2 compared directories */
+std::vector<Entry> treeEntries[2]; /* the files of both trees, sorted by path */
 
-void *Comparer(void *);
-void *Reader(void *);
+void Comparer(void *, long);
+void Reader(void *, long, long);
+void Scanner(void *, long, long);
+void Walker(void *, long, long);
+int diffFiles(const char *firstName, const char *secondName);
+int diffDirectories(bool checkContent);
+void readWhole(int fd, char **data, long *size);
+void readRest(int fd, char **data, long *size, long capacity);
+void readRange(int fd, char *data, long start, long end);
+void readChunk(ReadChunk *chunk);
+void scanBlocks(FilePair &pair, long first, long last);
+long countNewlines(const char *start, const char *end);
+void splitDiffering(FilePair &pair);
+void splitLines(FilePair &pair, long diffStart, long &pos, long &lineNumber);
+void walkTree(const std::string &root, const std::string &path, std::vector<Entry> &entries);
+void readPairTask(void *arg, long unused);
+void scanPairTask(void *arg, long first);
+void finishPair(FilePair *pair);
+void appendText(std::string &buffer, std::string &text);
+void appendLine(std::string &buffer, long lineNumber, const Line &line);
+void writeAll(std::string &buffer);
 
 /* read command line, initialize, and create threads */
 int main(int argc, char *argv[]) {
-    long lineCounter = 0;
-    std::string line;
-    std::string command;
-    
-    pthread_attr_t attr;
-    pthread_t fileReaders[2];
-    pthread_t comparers[NR_COMPARERS];
-    
-    /* set global thread attributes */
-    pthread_attr_init(&attr);
-    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
-    
-    /* initialize mutex */
-    pthread_mutex_init(&mutex, NULL);
+    bool checkContent = false;
+    int option;
+    struct stat info[2];
     
     /* read command line args */
 
+    while((option = getopt(argc, argv, "cj:r:")) != -1) {
+        if(option == 'c') {
+            checkContent = true;
+        } else if(option == 'j') {
+            nrWorkers = atoi(optarg);
+            if (nrWorkers < 1) nrWorkers = 1;
+        } else if(option == 'r') {
+            nrReaders = atoi(optarg);
+        } else {
+            argc = 0;
+        }
+    }
+    if (nrReaders > MAX_READERS) nrReaders = MAX_READERS;
+    if (nrReaders < 1) nrReaders = 1;
+    argv += optind - 1;
+    argc -= optind - 1;
     if(argc != 3) {
-        fprintf(stderr, "Usage: diff FILENAME FILENAME\n");
+        fprintf(stderr, "Usage: diff [-j WORKERS] [-r READERS] FILENAME FILENAME\n       diff [-c] [-j WORKERS] DIRECTORY DIRECTORY\n");
         exit(1);
     }
     
+    if(stat(argv[1], &info[0]) == 0 && stat(argv[2], &info[1]) == 0
+       && (S_ISDIR(info[0].st_mode) || S_ISDIR(info[1].st_mode))) {
+        if(!S_ISDIR(info[0].st_mode) || !S_ISDIR(info[1].st_mode)) {
+            fprintf(stderr, "Can not compare a directory with a file: %s %s\n", argv[1], argv[2]);
+            exit(1);
+        }
+        roots[0] = argv[1];
+        roots[1] = argv[2];
+    }
+    
+    /* start the pool, by default big enough for all the readers of both files to run at the same time */
+    if (nrWorkers == 0) nrWorkers = std::max(NR_COMPARERS, 2 * nrReaders);
+    runtimeStart(&runtime, nrWorkers);
+    int status = (roots[0].empty()) ? diffFiles(argv[1], argv[2]) : diffDirectories(checkContent);
+    runtimeStop(&runtime);
+    exit(status);
+}
+
+/* compares 2 files with the reader, scanner and comparer tasks and prints the differing lines in order */
+int diffFiles(const char *firstName, const char *secondName) {
+    long lineCounter = 0;
+    long sliceCounter = 0;
+    long nrSlices;
+    std::string outBuffer;
+    FilePair &pair = filePair;
+    
+    ReadChunk chunks[2 * MAX_READERS];
+    long nrChunks = 0;
+    TaskGroup comparers;
+    
     /* try to open both files for reading */
-    files[0].open(argv[1]);
-    files[1].open(argv[2]);
-    if (files[0].fail() || files[1].fail()) {
-        fprintf(stderr, "Failed to open file: %s for reading!\n", (files[0].fail()) ? argv[1] : argv[2]);
+    pair.files[0] = open(firstName, O_RDONLY);
+    pair.files[1] = open(secondName, O_RDONLY);
+    if (pair.files[0] < 0 || pair.files[1] < 0) {
+        fprintf(stderr, "Failed to open file: %s for reading!\n", (pair.files[0] < 0) ? firstName : secondName);
         exit(1);
     }
     
-    /* set to work the 2 reader workers for each file */
+    /* split both files into byte ranges and set the readers to work on them. Files whose size is
+     not known, like pipes or files in /proc that report size 0, are read by one reader from start
+     to end */
     for(long i = 0; i < 2; i++) {
-        pthread_create(&fileReaders[i], &attr, Reader, (void*)i);
+        struct stat info;
+        if(fstat(pair.files[i], &info) < 0) {
+            perror("fstat");
+            exit(1);
+        }
+        if(!S_ISREG(info.st_mode) || info.st_size == 0) {
+            chunks[nrChunks].fileIndex = i;
+            chunks[nrChunks].start = -1;
+            chunks[nrChunks].end = -1;
+            chunks[nrChunks].last = false;
+            chunks[nrChunks].tail = NULL;
+            chunks[nrChunks].tailSize = 0;
+            nrChunks++;
+            continue;
+        }
+        pair.fileSizes[i] = info.st_size;
+        pair.fileData[i] = (char *)malloc(std::max((long)info.st_size, 1L));
+        long fileChunks = std::min((long)nrReaders, (long)(info.st_size + MIN_READ_CHUNK - 1) / MIN_READ_CHUNK);
+        fileChunks = std::max(fileChunks, 1L);
+        long chunkSize = (info.st_size + fileChunks - 1) / fileChunks;
+        /* tell the kernel we read all of it, so readahead can run ahead of every reader. macOS has
+         no posix_fadvise and goes without the hint */
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(pair.files[i], 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(pair.files[i], 0, 0, POSIX_FADV_WILLNEED);
+#endif
+        for(long k = 0; k < fileChunks; k++) {
+            chunks[nrChunks].fileIndex = i;
+            chunks[nrChunks].start = std::min(k * chunkSize, (long)info.st_size);
+            chunks[nrChunks].end = std::min((k + 1) * chunkSize, (long)info.st_size);
+            chunks[nrChunks].last = k == fileChunks - 1;
+            chunks[nrChunks].tail = NULL;
+            chunks[nrChunks].tailSize = 0;
+            nrChunks++;
+        }
+    }
+    /* the parallel for returns when the readers are finished */
+    parallelFor(&runtime, 0, nrChunks, 1, Reader, chunks);
+    /* a file that grew since fstat gets the bytes its last range read past the size */
+    for(long k = 0; k < nrChunks; k++) {
+        if(chunks[k].tailSize > 0) {
+            long i = chunks[k].fileIndex;
+            pair.fileData[i] = (char *)realloc(pair.fileData[i], pair.fileSizes[i] + chunks[k].tailSize);
+            memcpy(pair.fileData[i] + pair.fileSizes[i], chunks[k].tail, chunks[k].tailSize);
+            pair.fileSizes[i] += chunks[k].tailSize;
+        }
+        free(chunks[k].tail);
     }
-    /* we wait until the readers are finished */
     for(long i = 0; i < 2; i++) {
-        pthread_join(fileReaders[i], NULL);
+        if(pair.files[i] >= 0) {
+            close(pair.files[i]);
+        }
     }
     
+    /* let the scanners find the identical blocks */
+    pair.minSize = std::min(pair.fileSizes[0], pair.fileSizes[1]);
+    pair.nrBlocks = (pair.minSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    pair.blockSame.resize(pair.nrBlocks, false);
+    pair.blockNewlines.resize(pair.nrBlocks, 0);
+    parallelFor(&runtime, 0, pair.nrBlocks, 1, Scanner, &pair);
+    
+    /* skip the identical regions and split only the differing regions into lines */
+    splitDiffering(pair);
+    
+    std::vector<Line> *fileLines = pair.fileLines;
+    std::vector<long> &lineNumbers = pair.lineNumbers;
     minLines = std::min(fileLines[0].size(), fileLines[1].size());
-    /* initiate att line statuses to UNCHECKED */
+    /* initiate att line statuses to UNCHECKED and no slice as published */
     lineStatus.resize(minLines, UNCHECKED);
+    nrSlices = (minLines + slizeSize - 1) / slizeSize;
+    sliceDone = new std::atomic<bool>[nrSlices];
+    for(long i = 0; i < nrSlices; i++) {
+        sliceDone[i].store(false, std::memory_order_relaxed);
+    }
+    outBuffer.reserve(OUTPUT_BUFFER_SIZE + 4096);
     
     /* set the comparers in work to evaluate each line up to minLines */
+    taskGroupInit(&comparers);
     for(long i = 0; i < NR_COMPARERS; i++) {
-        pthread_create(&comparers[i], &attr, Comparer, NULL);
+        runtimeSubmit(&runtime, &comparers, Comparer, NULL, i);
     }
     
-    /* while the comparers are working, the main thread evaluates the lines in order
-     but only progresses if the lines have been checked. */
-    while(lineCounter < minLines) {
-        int status = lineStatus[lineCounter];
-        if(status == UNCHECKED) {
-            /* the line has not been checked yet, so we yield this timeslice and look again later */
-            pthread_yield_np();
-        } else {
-            if(status == UNEQUAL) {
-                /* print the lines */
-                printf("(%lu): %s\n", lineCounter + 1, fileLines[0][lineCounter].c_str());
-                printf("(%lu): %s\n", lineCounter + 1, fileLines[1][lineCounter].c_str());
+    /* while the comparers are working, the main thread commits the slices in order
+     but only progresses when the next slice has been published. */
+    while(sliceCounter < nrSlices) {
+        if(!sliceDone[sliceCounter].load(std::memory_order_acquire)) {
+            /* flush what we have before sleeping so the output does not stall behind a slow slice */
+            writeAll(outBuffer);
+            while(true) {
+                int key = eventPrepare(&published);
+                if(sliceDone[sliceCounter].load(std::memory_order_acquire)) {
+                    eventCancel(&published);
+                    break;
+                }
+                eventWait(&published, key);
+            }
+        }
+        /* the acquire load above makes the line statuses of the whole slice visible */
+        long sliceEnd = std::min(lineCounter + slizeSize, minLines);
+        for( ; lineCounter < sliceEnd; lineCounter++) {
+            if(lineStatus[lineCounter] == UNEQUAL) {
+                appendLine(outBuffer, lineNumbers[lineCounter], fileLines[0][lineCounter]);
+                appendLine(outBuffer, lineNumbers[lineCounter], fileLines[1][lineCounter]);
             }
-            lineCounter++;
         }
+        if(outBuffer.size() >= OUTPUT_BUFFER_SIZE) {
+            writeAll(outBuffer);
+        }
+        sliceCounter++;
     }
     
     /* we print each line of the longest file, beginning at minLines. */
-    std::vector<std::string> longestFileLines (fileLines[0].size() > fileLines[1].size() ? fileLines[0] : fileLines[1]);
+    const std::vector<Line>& longestFileLines = fileLines[0].size() > fileLines[1].size() ? fileLines[0] : fileLines[1];
     for( ; lineCounter < longestFileLines.size(); lineCounter++){
-        printf("(%lu): %s\n", lineCounter + 1, longestFileLines[lineCounter].c_str());
+        appendLine(outBuffer, lineNumbers[lineCounter], longestFileLines[lineCounter]);
+        if(outBuffer.size() >= OUTPUT_BUFFER_SIZE) {
+            writeAll(outBuffer);
+        }
+    }
+    writeAll(outBuffer);
+    
+    taskGroupWait(&runtime, &comparers);
+    delete[] sliceDone;
+    return 0;
+}
+
+/* compares 2 directory trees. The walkers list both trees, the matched files that might differ are
+ * diffed by the pool and the main thread prints the results in path order as they are published.
+ */
+int diffDirectories(bool checkContent) {
+    std::vector<FilePair *> pairs;
+    std::vector<FilePair *> work;
+    std::string outBuffer;
+    TaskGroup pairTasks;
+    
+    /* walk both trees at the same time */
+    parallelFor(&runtime, 0, 2, 1, Walker, NULL);
+    
+    /* match the sorted paths of both trees. Pairs that are the same file, or have the same size and
+     modification time unless the content should be checked, are identical and never read */
+    std::vector<Entry> &first = treeEntries[0];
+    std::vector<Entry> &second = treeEntries[1];
+    size_t i = 0, j = 0;
+    while(i < first.size() || j < second.size()) {
+        int order = (i == first.size()) ? 1 : (j == second.size()) ? -1 : first[i].path.compare(second[j].path);
+        FilePair *pair = new FilePair();
+        bool needsDiff = false;
+        if(order < 0) {
+            /* a file in only one of the trees is printed as is */
+            pair->output = "Only in " + roots[0] + ": " + first[i++].path + "\n";
+        } else if(order > 0) {
+            pair->output = "Only in " + roots[1] + ": " + second[j++].path + "\n";
+        } else {
+            pair->path = first[i].path;
+            bool sameFile = first[i].device == second[j].device && first[i].inode == second[j].inode;
+            bool sameStat = first[i].size == second[j].size
+                            && first[i].modified.tv_sec == second[j].modified.tv_sec
+                            && first[i].modified.tv_nsec == second[j].modified.tv_nsec;
+            needsDiff = !sameFile && (checkContent || !sameStat);
+            pair->fileSizes[0] = first[i++].size;
+            pair->fileSizes[1] = second[j++].size;
+        }
+        if(needsDiff) {
+            work.push_back(pair);
+        } else {
+            pair->done.store(true, std::memory_order_relaxed);
+        }
+        pairs.push_back(pair);
+    }
+    
+    /* hand out the pairs biggest first, so the huge files are started early and the small ones fill
+     the gaps at the end. A worker runs its own queue in order and steals from the others when empty */
+    std::sort(work.begin(), work.end(), [](FilePair *a, FilePair *b) {
+        return std::max(a->fileSizes[0], a->fileSizes[1]) > std::max(b->fileSizes[0], b->fileSizes[1]);
+    });
+    taskGroupInit(&pairTasks);
+    for(size_t k = 0; k < work.size(); k++) {
+        runtimeSubmit(&runtime, &pairTasks, readPairTask, work[k], 0);
+    }
+    
+    /* print the pairs in path order, waiting for the pool like the file printer waits for slices */
+    outBuffer.reserve(OUTPUT_BUFFER_SIZE + 4096);
+    for(size_t k = 0; k < pairs.size(); k++) {
+        FilePair *pair = pairs[k];
+        if(!pair->done.load(std::memory_order_acquire)) {
+            writeAll(outBuffer);
+            while(true) {
+                int key = eventPrepare(&published);
+                if(pair->done.load(std::memory_order_acquire)) {
+                    eventCancel(&published);
+                    break;
+                }
+                eventWait(&published, key);
+            }
+        }
+        appendText(outBuffer, pair->output);
+        delete pair;
+        if(outBuffer.size() >= OUTPUT_BUFFER_SIZE) {
+            writeAll(outBuffer);
+        }
+    }
+    writeAll(outBuffer);
+    
+    taskGroupWait(&runtime, &pairTasks);
+    return 0;
+}
+
+/* reads the whole content of the file into a new buffer and closes it */
+void readWhole(int fd, char **data, long *size) {
+    struct stat info;
+    if(fstat(fd, &info) < 0) {
+        perror("fstat");
+        exit(1);
+    }
+    readRest(fd, data, size, (info.st_size > 0) ? info.st_size : 4096);
+    close(fd);
+}
+
+/* reads from the current position of the file up to its end into a new buffer of at least capacity
+ * bytes, which grows as needed */
+void readRest(int fd, char **data, long *size, long capacity) {
+    long length = 0;
+    char *buffer = (char *)malloc(capacity);
+    while(true) {
+        if(length == capacity) {
+            /* the file was not a regular file or it grew, so we make room for more */
+            capacity *= 2;
+            buffer = (char *)realloc(buffer, capacity);
+        }
+        ssize_t bytes = read(fd, buffer + length, capacity - length);
+        if(bytes < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            exit(1);
+        }
+        if(bytes == 0) {
+            break;
+        }
+        length += bytes;
+    }
+    *data = buffer;
+    *size = length;
+}
+
+/* reads the bytes start up to end of the file into the same offsets of data */
+void readRange(int fd, char *data, long start, long end) {
+    while(start < end) {
+        ssize_t bytes = pread(fd, data + start, end - start, start);
+        if(bytes < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("pread");
+            exit(1);
+        }
+        if(bytes == 0) {
+            /* the file was truncated while reading */
+            fprintf(stderr, "Unexpected end of file while reading!\n");
+            exit(1);
+        }
+        start += bytes;
+    }
+}
+
+/* compares the blocks first up to last in both files with memcmp, which the C library vectorizes.
+ * The newlines of identical blocks are counted so that they can be skipped while still keeping
+ * track of the line numbers.
+ */
+void scanBlocks(FilePair &pair, long first, long last) {
+    for(long block = first; block < last; block++) {
+        long start = block * BLOCK_SIZE;
+        long length = std::min((long)BLOCK_SIZE, pair.minSize - start);
+        if(memcmp(pair.fileData[0] + start, pair.fileData[1] + start, length) == 0) {
+            pair.blockSame[block] = true;
+            pair.blockNewlines[block] = countNewlines(pair.fileData[0] + start, pair.fileData[0] + start + length);
+        }
     }
-    exit(0);
 }
 
-/* a reader simply reads from a file and just fills its line vector */
-void *Reader(void *arg) {
-    long fileIndex = (long)arg;
-    std::ifstream& readFile = files[fileIndex];
-    std::string line;
-    while(std::getline(readFile, line)) {
-        fileLines[fileIndex].push_back(line);
+/* counts the newlines between start and end. memchr is vectorized by the C library */
+long countNewlines(const char *start, const char *end) {
+    long count = 0;
+    while(start < end && (start = (const char *)memchr(start, '\n', end - start)) != NULL) {
+        count++;
+        start++;
     }
-    pthread_exit(NULL);
+    return count;
+}
+
+/* skips the identical regions of a scanned pair and splits only the differing regions into lines.
+ * pos is always at the start of a line at the same offset in both files.
+ */
+void splitDiffering(FilePair &pair) {
+    long pos = 0;
+    long lineNumber = 0;
+    long block = 0;
+    while(true) {
+        /* find the next differing block. If the sizes differ, everything past minSize differs */
+        while(block < pair.nrBlocks && (pair.blockSame[block] || (block + 1) * (long)BLOCK_SIZE <= pos)) {
+            block++;
+        }
+        long diffStart;
+        if(block < pair.nrBlocks) {
+            diffStart = std::max(pos, block * (long)BLOCK_SIZE);
+        } else if(pair.fileSizes[0] != pair.fileSizes[1]) {
+            diffStart = std::max(pos, pair.minSize);
+        } else {
+            break;
+        }
+        /* widen the differing region back to the start of its first line, the bytes before are identical */
+        long regionStart = diffStart;
+        while(regionStart > pos && pair.fileData[0][regionStart - 1] != '\n') {
+            regionStart--;
+        }
+        /* count the lines we skip, whole identical blocks are already counted by the scanners */
+        long skipBlock = pos / BLOCK_SIZE;
+        if(pos % BLOCK_SIZE != 0 || (skipBlock + 1) * (long)BLOCK_SIZE > regionStart) {
+            long skipEnd = std::min((skipBlock + 1) * (long)BLOCK_SIZE, regionStart);
+            lineNumber += countNewlines(pair.fileData[0] + pos, pair.fileData[0] + skipEnd);
+            skipBlock++;
+        }
+        for( ; (skipBlock + 1) * (long)BLOCK_SIZE <= regionStart; skipBlock++) {
+            lineNumber += pair.blockNewlines[skipBlock];
+        }
+        if(skipBlock * (long)BLOCK_SIZE < regionStart) {
+            lineNumber += countNewlines(pair.fileData[0] + skipBlock * BLOCK_SIZE, pair.fileData[0] + regionStart);
+        }
+        pos = regionStart;
+        splitLines(pair, diffStart, pos, lineNumber);
+        if(pos < 0) {
+            break;
+        }
+    }
+}
+
+/* splits the lines from pos in both files in lockstep into fileLines, numbering them from lineNumber.
+ * stops at the first line start after diffStart that is at the same offset in both files and lies in
+ * an identical block, so the caller can skip ahead again. pos is set to -1 when both files have ended.
+ */
+void splitLines(FilePair &pair, long diffStart, long &pos, long &lineNumber) {
+    long positions[2] = {pos, pos};
+    while(true) {
+        if(positions[0] == positions[1] && positions[0] >= diffStart
+           && positions[0] < pair.minSize && pair.blockSame[positions[0] / BLOCK_SIZE]) {
+            pos = positions[0];
+            return;
+        }
+        if(positions[0] >= pair.fileSizes[0] && positions[1] >= pair.fileSizes[1]) {
+            pos = -1;
+            return;
+        }
+        for(int i = 0; i < 2; i++) {
+            if(positions[i] < pair.fileSizes[i]) {
+                const char *start = pair.fileData[i] + positions[i];
+                const char *end = (const char *)memchr(start, '\n', pair.fileSizes[i] - positions[i]);
+                Line line;
+                line.start = start;
+                line.length = (end != NULL) ? end - start : pair.fileSizes[i] - positions[i];
+                pair.fileLines[i].push_back(line);
+                positions[i] += line.length + 1;
+            }
+        }
+        pair.lineNumbers.push_back(++lineNumber);
+    }
+}
+
+/* the modification time of a file, macOS names the field differently */
+struct timespec modificationTime(const struct stat &info) {
+#ifdef __APPLE__
+    return info.st_mtimespec;
+#else
+    return info.st_mtim;
+#endif
+}
+
+/* recursively lists the regular files below root/path, with paths relative to root. A symbolic
+ link to a file is listed as that file, other links are reported and skipped */
+void walkTree(const std::string &root, const std::string &path, std::vector<Entry> &entries) {
+    std::string directory = path.empty() ? root : root + "/" + path;
+    DIR *dir = opendir(directory.c_str());
+    if(dir == NULL) {
+        fprintf(stderr, "Failed to open directory: %s for reading!\n", directory.c_str());
+        exit(1);
+    }
+    struct dirent *dirEntry;
+    while((dirEntry = readdir(dir)) != NULL) {
+        if(strcmp(dirEntry->d_name, ".") == 0 || strcmp(dirEntry->d_name, "..") == 0) {
+            continue;
+        }
+        std::string name = path.empty() ? dirEntry->d_name : path + "/" + dirEntry->d_name;
+        std::string fullName = root + "/" + name;
+        struct stat info;
+        if(lstat(fullName.c_str(), &info) < 0) {
+            continue;
+        }
+        bool link = S_ISLNK(info.st_mode);
+        if(link && stat(fullName.c_str(), &info) < 0) {
+            fprintf(stderr, "Skipping broken symbolic link: %s\n", fullName.c_str());
+            continue;
+        }
+        if(S_ISDIR(info.st_mode)) {
+            if(link) {
+                /* not followed, since it could lead back into the tree */
+                fprintf(stderr, "Skipping symbolic link to a directory: %s\n", fullName.c_str());
+            } else {
+                walkTree(root, name, entries);
+            }
+        } else if(S_ISREG(info.st_mode)) {
+            Entry entry;
+            entry.path = name;
+            entry.size = info.st_size;
+            entry.modified = modificationTime(info);
+            entry.device = info.st_dev;
+            entry.inode = info.st_ino;
+            entries.push_back(entry);
+        }
+    }
+    closedir(dir);
+}
+
+/* reads both files of a pair. Small pairs are scanned right away, bigger ones are split into
+ * scan tasks on the queue of this worker so that idle workers can steal them.
+ */
+void readPairTask(void *arg, long unused) {
+    FilePair *pair = (FilePair *)arg;
+    for(int i = 0; i < 2; i++) {
+        std::string name = roots[i] + "/" + pair->path;
+        pair->files[i] = open(name.c_str(), O_RDONLY);
+        if(pair->files[i] < 0) {
+            fprintf(stderr, "Failed to open file: %s for reading!\n", name.c_str());
+            exit(1);
+        }
+        readWhole(pair->files[i], &pair->fileData[i], &pair->fileSizes[i]);
+    }
+    pair->minSize = std::min(pair->fileSizes[0], pair->fileSizes[1]);
+    pair->nrBlocks = (pair->minSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    pair->blockSame.resize(pair->nrBlocks, false);
+    pair->blockNewlines.resize(pair->nrBlocks, 0);
+    if(pair->nrBlocks <= SCAN_GRAIN) {
+        scanBlocks(*pair, 0, pair->nrBlocks);
+        finishPair(pair);
+        return;
+    }
+    long nrChunks = (pair->nrBlocks + SCAN_GRAIN - 1) / SCAN_GRAIN;
+    pair->chunksLeft.store(nrChunks);
+    for(long chunk = 0; chunk < nrChunks; chunk++) {
+        runtimeSubmit(&runtime, NULL, scanPairTask, pair, chunk * SCAN_GRAIN);
+    }
+}
+
+/* scans SCAN_GRAIN blocks of a pair, the task finishing the last blocks finishes the pair */
+void scanPairTask(void *arg, long first) {
+    FilePair *pair = (FilePair *)arg;
+    scanBlocks(*pair, first, std::min(first + SCAN_GRAIN, pair->nrBlocks));
+    if(pair->chunksLeft.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        finishPair(pair);
+    }
+}
+
+/* compares the differing lines of a scanned pair, formats them and publishes the pair to the printer */
+void finishPair(FilePair *pair) {
+    splitDiffering(*pair);
+    std::vector<Line> *fileLines = pair->fileLines;
+    long pairMinLines = std::min(fileLines[0].size(), fileLines[1].size());
+    long longest = std::max(fileLines[0].size(), fileLines[1].size());
+    std::string &output = pair->output;
+    for(long i = 0; i < longest; i++) {
+        if(i < pairMinLines) {
+            const Line &first = fileLines[0][i];
+            const Line &second = fileLines[1][i];
+            if(first.length == second.length && memcmp(first.start, second.start, first.length) == 0) {
+                continue;
+            }
+        }
+        if(output.empty()) {
+            output = "diff " + roots[0] + "/" + pair->path + " " + roots[1] + "/" + pair->path + "\n";
+        }
+        for(int k = 0; k < 2; k++) {
+            if(i < fileLines[k].size()) {
+                appendLine(output, pair->lineNumbers[i], fileLines[k][i]);
+            }
+        }
+    }
+    /* the printer only needs the output, so the file content is released right away */
+    for(int k = 0; k < 2; k++) {
+        free(pair->fileData[k]);
+        std::vector<Line>().swap(fileLines[k]);
+    }
+    std::vector<long>().swap(pair->lineNumbers);
+    std::vector<char>().swap(pair->blockSame);
+    std::vector<long>().swap(pair->blockNewlines);
+    pair->done.store(true, std::memory_order_release);
+    eventNotify(&published, false);
+}
+
+/* appends text to the buffer, text larger than the buffer is written directly instead of being copied */
+void appendText(std::string &buffer, std::string &text) {
+    if(text.size() >= OUTPUT_BUFFER_SIZE) {
+        writeAll(buffer);
+        writeAll(text);
+    } else {
+        buffer.append(text);
+    }
+}
+
+/* formats "(lineNumber): line" into the buffer, same format as printf("(%lu): %s\n") */
+void appendLine(std::string &buffer, long lineNumber, const Line &line) {
+    char digits[24];
+    int length = 0;
+    do {
+        digits[length++] = '0' + lineNumber % 10;
+        lineNumber /= 10;
+    } while(lineNumber > 0);
+    buffer.push_back('(');
+    while(length > 0) {
+        buffer.push_back(digits[--length]);
+    }
+    buffer.append("): ", 3);
+    buffer.append(line.start, line.length);
+    buffer.push_back('\n');
+}
+
+/* writes the whole buffer to the standard output with as few write calls as possible and clears it */
+void writeAll(std::string &buffer) {
+    const char *data = buffer.data();
+    size_t left = buffer.size();
+    while(left > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, left);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(1);
+        }
+        data += written;
+        left -= written;
+    }
+    buffer.clear();
+}
+
+/* a reader reads one byte range of its file into fileData. Lines crossing the end of the range are
+ * resolved for free since all the ranges of a file end up next to each other in the same buffer.
+ */
+void Reader(void *arg, long first, long last) {
+    for(long i = first; i < last; i++) {
+        readChunk(&((ReadChunk *)arg)[i]);
+    }
+}
+
+void readChunk(ReadChunk *chunk) {
+    long fileIndex = chunk->fileIndex;
+    if(chunk->start < 0) {
+        readWhole(filePair.files[fileIndex], &filePair.fileData[fileIndex], &filePair.fileSizes[fileIndex]);
+        /* readWhole closes the file */
+        filePair.files[fileIndex] = -1;
+    } else {
+        readRange(filePair.files[fileIndex], filePair.fileData[fileIndex], chunk->start, chunk->end);
+        if(chunk->last) {
+            /* only this reader uses the file position, the others read with pread */
+            lseek(filePair.files[fileIndex], chunk->end, SEEK_SET);
+            readRest(filePair.files[fileIndex], &chunk->tail, &chunk->tailSize, 4096);
+        }
+    }
+}
+
+/* a walker lists the files of the directory trees first up to last, sorted by path */
+void Walker(void *arg, long first, long last) {
+    for(long treeIndex = first; treeIndex < last; treeIndex++) {
+        walkTree(roots[treeIndex], "", treeEntries[treeIndex]);
+        std::sort(treeEntries[treeIndex].begin(), treeEntries[treeIndex].end(), [](const Entry &a, const Entry &b) {
+            return a.path < b.path;
+        });
+    }
+}
+
+/* a scanner compares the blocks first up to last of the pair in both files */
+void Scanner(void *arg, long first, long last) {
+    scanBlocks(*(FilePair *)arg, first, last);
 }
 
 /* a comparer compares up to slizeSize amount of lines and updates the lineStatus of those lines.
+ * when the slice is finished it is published to the main thread with release semantics.
  * the comparer will also grab slizeSize newlines when the first lines are finished and exits when
  * it has gone past minLines of both files.
  */
-void *Comparer(void *arg) {
+void Comparer(void *arg, long index) {
+    std::vector<Line> *fileLines = filePair.fileLines;
     while(true){
-        pthread_mutex_lock(&mutex);
-        /* we lock here since we are updating and using the global variable nextLine */
-        long startLine = nextLine;
-        nextLine += slizeSize;
-        pthread_mutex_unlock(&mutex);
+        /* take the next slice from the bag */
+        long startLine = nextLine.fetch_add(slizeSize, std::memory_order_relaxed);
         if(startLine >= minLines) {
             break;
         }
         for(long i = startLine; i < startLine + slizeSize && i < minLines; i++) {
             /* we compare each line and just updates the status so that the main thread can continue printing */
-            if(fileLines[0][i] != fileLines[1][i]) {
+            const Line &first = fileLines[0][i];
+            const Line &second = fileLines[1][i];
+            if(first.length != second.length || memcmp(first.start, second.start, first.length) != 0) {
                 lineStatus[i] = UNEQUAL;
             } else {
                 lineStatus[i] = EQUAL;
             }
         }
+        sliceDone[startLine / slizeSize].store(true, std::memory_order_release);
+        /* wake the main thread if it is sleeping, it might be waiting for the slice we just published */
+        eventNotify(&published, false);
     }
-    pthread_exit(NULL);
-}
\ No newline at end of file
+}
@@ -0,0 +1,213 @@
+#!/bin/sh
+# benchmark driver for HW1, HW4 and HW5
+#
+# features: generates reproducible workloads, runs every built
+# variant of a tool RUNS times for each workload and thread count,
+# and writes the median, 10th and 90th percentile times and the
+# throughput to bench/results/TOOL.csv. If bench/baseline/TOOL.csv
+# exists the medians are compared against it.
+#
+# usage (from the directory of the tool, normally through 'make bench'):
+# sh ../bench/bench.sh hw1|hw4|hw5
+#
+# environment:
+# RUNS      runs of each configuration (7)
+# THREADS   thread counts to sweep ("1 2 4 8"), for HW5 the size of the worker pool
+# VARIANTS  builds to run ("plain opt lto pgo"), a missing build is skipped
+# SIZES     HW1 matrix sizes ("500 2000 5000 10000")
+# GRAINS    HW1 rows a thread takes at a time with the row and column statistics ("1 8 32 128")
+# LINES     lines of the HW4 and HW5 workloads (2000000)
+# STREAMS   named pipes the HW4 -m workload splits its lines over (256)
+# DENSITIES HW5 fraction of differing lines ("0 0.001 0.1 1")
+# READERS   HW5 readers of each file ("4")
+
+TOOL=$1
+BENCH=$(cd "$(dirname "$0")" && pwd)
+RUNS=${RUNS:-7}
+THREADS=${THREADS:-"1 2 4 8"}
+VARIANTS=${VARIANTS:-"plain opt lto pgo"}
+SIZES=${SIZES:-"500 2000 5000 10000"}
+GRAINS=${GRAINS:-"1 8 32 128"}
+LINES=${LINES:-2000000}
+STREAMS=${STREAMS:-256}
+DENSITIES=${DENSITIES:-"0 0.001 0.1 1"}
+READERS=${READERS:-4}
+WORK=$BENCH/work
+RESULTS=$BENCH/results
+BASELINE=$BENCH/baseline
+
+mkdir -p "$WORK" "$RESULTS"
+CSV=$RESULTS/$TOOL.csv
+echo "tool,program,variant,workload,threads,runs,median_s,p10_s,p90_s,throughput,unit" > "$CSV"
+
+# binary name of a variant, the plain build is the one made by 'make'
+binary() {
+    if [ "$2" = plain ]; then echo "./$1"; else echo "./$1-$2"; fi
+}
+
+# seconds since the epoch with sub-second precision. %N is a GNU date
+# extension that BSD and macOS date print literally, there the time
+# comes from perl or python3
+if date +%N | grep -q '^[0-9]*$'; then
+    now() { date +%s.%N; }
+elif command -v perl > /dev/null && perl -MTime::HiRes -e 1 2> /dev/null; then
+    now() { perl -MTime::HiRes=time -e 'printf "%.6f\n", time'; }
+elif command -v python3 > /dev/null; then
+    now() { python3 -c 'import time; print("%.6f" % time.time())'; }
+else
+    echo "bench.sh: no clock with sub-second precision (GNU date, perl or python3)" >&2
+    exit 1
+fi
+
+# reads one time per line and prints "median p10 p90"
+percentiles() {
+    sort -n | awk '{ t[NR] = $1 }
+        function at(p,   i) { i = int(p * NR + 0.999999); if (i < 1) i = 1; return t[i] }
+        END { printf "%.6f %.6f %.6f\n", at(0.5), at(0.1), at(0.9) }'
+}
+
+# record PROGRAM VARIANT WORKLOAD THREADS AMOUNT UNIT < times
+record() {
+    set -- "$1" "$2" "$3" "$4" "$5" "$6" $(percentiles)
+    throughput=$(awk -v a="$5" -v t="$7" 'BEGIN { if (t > 0) printf "%.2f", a / t; else print "inf" }')
+    echo "$TOOL,$1,$2,$3,$4,$RUNS,$7,$8,$9,$throughput,$6" >> "$CSV"
+    echo "$1 $2 $3 threads=$4 median=${7}s p10=${8}s p90=${9}s $throughput $6"
+}
+
+# HW1 reports the time of its parallel part itself, so matrix initialization is not measured
+bench_hw1() {
+    for program in a b c; do
+        for variant in $VARIANTS; do
+            bin=$(binary $program $variant)
+            [ -x "$bin" ] || continue
+            for size in $SIZES; do
+                for threads in $THREADS; do
+                    run=0
+                    while [ $run -lt $RUNS ]; do
+                        "$bin" $size $threads | awk '/execution time/ { print $5 }'
+                        run=$((run + 1))
+                    done | record $program $variant matrix$size $threads $((size * size)) elements/s
+                done
+            done
+        done
+    done
+    
+    # c with a statistics file times the global values alone (c-global) and together with the row
+    # and column statistics (c-stats) in one run, for every grain size
+    for variant in $VARIANTS; do
+        bin=$(binary c $variant)
+        [ -x "$bin" ] || continue
+        for size in $SIZES; do
+            for threads in $THREADS; do
+                for grain in $GRAINS; do
+                    rm -f "$WORK/hw1-global.txt" "$WORK/hw1-stats.txt"
+                    run=0
+                    while [ $run -lt $RUNS ]; do
+                        "$bin" $size $threads $grain "$WORK/hw1-statistics.csv" > "$WORK/hw1-run.txt"
+                        awk '/execution time without statistics/ { print $7 }' "$WORK/hw1-run.txt" >> "$WORK/hw1-global.txt"
+                        awk '/^The execution time is/ { print $5 }' "$WORK/hw1-run.txt" >> "$WORK/hw1-stats.txt"
+                        run=$((run + 1))
+                    done
+                    record c-global $variant matrix$size-grain$grain $threads $((size * size)) elements/s < "$WORK/hw1-global.txt"
+                    record c-stats $variant matrix$size-grain$grain $threads $((size * size)) elements/s < "$WORK/hw1-stats.txt"
+                done
+            done
+        done
+    done
+}
+
+# HW4 copies a stream of lines ending with 'exit', its number of writer threads is fixed
+bench_hw4() {
+    input=$WORK/tee-$LINES.txt
+    if [ ! -f "$input" ]; then
+        awk -v n=$LINES 'BEGIN { srand(4); for (i = 0; i < n; i++) printf "line %d %d\n", i, int(rand() * 1000000000); print "exit" }' > "$input"
+    fi
+    bytes=$(wc -c < "$input")
+    for variant in $VARIANTS; do
+        bin=$(binary tee $variant)
+        [ -x "$bin" ] || continue
+        run=0
+        while [ $run -lt $RUNS ]; do
+            start=$(now)
+            "$bin" "$WORK/tee-out.txt" < "$input" > /dev/null
+            end=$(now)
+            awk -v s=$start -v e=$end 'BEGIN { printf "%.6f\n", e - s }'
+            run=$((run + 1))
+        done | record tee $variant lines$LINES 2 $bytes bytes/s
+    done
+    
+    # the -m event loop copies the same lines split over STREAMS named pipes into one shared file
+    parts=$WORK/tee-streams
+    rm -rf "$parts"
+    mkdir -p "$parts"
+    split -n l/$STREAMS "$input" "$parts/part"
+    specs=""
+    for part in "$parts"/part*; do
+        mkfifo "$parts/pipe-${part##*/}"
+        specs="$specs $parts/pipe-${part##*/}=$WORK/tee-streams-out.txt"
+    done
+    for variant in $VARIANTS; do
+        bin=$(binary tee $variant)
+        [ -x "$bin" ] || continue
+        run=0
+        while [ $run -lt $RUNS ]; do
+            start=$(now)
+            "$bin" -m $specs &
+            for part in "$parts"/part*; do
+                cat "$part" > "$parts/pipe-${part##*/}" &
+            done
+            wait
+            end=$(now)
+            awk -v s=$start -v e=$end 'BEGIN { printf "%.6f\n", e - s }'
+            run=$((run + 1))
+        done | record tee-streams $variant streams$STREAMS 1 $bytes bytes/s
+    done
+}
+
+# HW5 compares pairs where the given fraction of the lines differ, sweeping the number of readers
+bench_hw5() {
+    for density in $DENSITIES; do
+        first=$WORK/diff-$LINES-a.txt
+        second=$WORK/diff-$LINES-$density.txt
+        if [ ! -f "$first" ]; then
+            awk -v n=$LINES 'BEGIN { srand(5); for (i = 0; i < n; i++) printf "row %d payload %d\n", i, int(rand() * 1000000000) }' > "$first"
+        fi
+        if [ ! -f "$second" ]; then
+            awk -v d=$density 'BEGIN { srand(6) } { if (rand() < d) print $0 "x"; else print }' "$first" > "$second"
+        fi
+        bytes=$(($(wc -c < "$first") + $(wc -c < "$second")))
+        for variant in $VARIANTS; do
+            bin=$(binary diff $variant)
+            [ -x "$bin" ] || continue
+            for readers in $READERS; do
+                for threads in $THREADS; do
+                    run=0
+                    while [ $run -lt $RUNS ]; do
+                        start=$(now)
+                        "$bin" -j $threads -r $readers "$first" "$second" > /dev/null
+                        end=$(now)
+                        awk -v s=$start -v e=$end 'BEGIN { printf "%.6f\n", e - s }'
+                        run=$((run + 1))
+                    done | record diff $variant density$density-readers$readers $threads $bytes bytes/s
+                done
+            done
+        done
+    done
+}
+
+case "$TOOL" in
+    hw1) bench_hw1 ;;
+    hw4) bench_hw4 ;;
+    hw5) bench_hw5 ;;
+    *) echo "Usage: bench.sh hw1|hw4|hw5" >&2; exit 1 ;;
+esac
+
+# compare the medians with the saved baseline, a speedup above 1 means faster than the baseline
+if [ -f "$BASELINE/$TOOL.csv" ]; then
+    echo "compared to $BASELINE/$TOOL.csv:"
+    awk -F, 'NR == FNR { if (FNR > 1) base[$2 "," $3 "," $4 "," $5] = $7; next }
+        FNR > 1 { key = $2 "," $3 "," $4 "," $5
+            if (key in base && $7 > 0) printf "%s %s %s threads=%s speedup %.2f\n", $2, $3, $4, $5, base[key] / $7 }' \
+        "$BASELINE/$TOOL.csv" "$CSV"
+fi
+echo "results written to $CSV"
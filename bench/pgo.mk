@@ -0,0 +1,17 @@
+# profile guided build flags shared by the HW Makefiles
+#
+# GCC reads its .gcda profiles directly. Clang, which is what g++ runs on
+# macOS, writes .profraw files that llvm-profdata has to merge into a
+# .profdata file first. Use $(call PROFILE_MERGE,name) after the training
+# run and $(call PROFILE_USE,name) when building with the profile.
+
+CLANG := $(shell g++ --version 2>/dev/null | grep -c clang)
+PROFDATA := $(shell xcrun -f llvm-profdata 2>/dev/null || echo llvm-profdata)
+
+ifeq ($(CLANG),0)
+PROFILE_MERGE = true
+PROFILE_USE = -fprofile-use -fprofile-correction
+else
+PROFILE_MERGE = $(PROFDATA) merge -output=$(1).profdata *.profraw && rm -f *.profraw
+PROFILE_USE = -fprofile-use=$(1).profdata
+endif
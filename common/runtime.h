@@ -0,0 +1,400 @@
+/* a small task runtime shared by HW1, HW4 and HW5
+
+ features: a fixed pool of worker threads, each with a
+ lock-free bounded MPMC task queue. A worker runs the
+ tasks of its own queue and steals from the others when
+ it is empty. Idle workers and waiting threads are parked
+ on a futex instead of yielding. On top of that there is a
+ parallel for with a configurable grain size and a
+ reduction with one cache line per thread.
+
+ usage:
+ #include "../common/runtime.h"
+ runtimeStart(&runtime, workers);
+ parallelFor(&runtime, 0, n, grain, function, arg);
+ runtimeStop(&runtime);
+
+ */
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <atomic>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#define CACHE_LINE 64             /* size of a cache line in bytes */
+#define RUNTIME_QUEUE_SIZE 4096   /* tasks in one worker queue, must be a power of 2 */
+#define RUNTIME_MAX_WORKERS 256   /* maximum number of worker threads */
+
+/* parks the calling thread while *word is expected, wakes up to count threads parked on word.
+ * Linux uses a futex, other systems fall back on one shared condition variable */
+#ifdef __linux__
+static inline void parkWait(std::atomic<int> *word, int expected) {
+    syscall(SYS_futex, (int *)word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static inline void parkWake(std::atomic<int> *word, int count) {
+    syscall(SYS_futex, (int *)word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+#else
+static pthread_mutex_t parkMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parkCond = PTHREAD_COND_INITIALIZER;
+
+static inline void parkWait(std::atomic<int> *word, int expected) {
+    pthread_mutex_lock(&parkMutex);
+    if(word->load() == expected) {
+        pthread_cond_wait(&parkCond, &parkMutex);
+    }
+    pthread_mutex_unlock(&parkMutex);
+}
+
+static inline void parkWake(std::atomic<int> *word, int count) {
+    pthread_mutex_lock(&parkMutex);
+    pthread_cond_broadcast(&parkCond);
+    pthread_mutex_unlock(&parkMutex);
+}
+#endif
+
+/* an event count lets a thread sleep until some condition might have changed without lost wakeups:
+ *   key = eventPrepare(&event); if(condition) eventCancel(&event); else eventWait(&event, key);
+ * and the other side makes the condition true before calling eventNotify.
+ */
+struct EventCount {
+    std::atomic<int> epoch;
+    std::atomic<int> waiters;
+};
+
+static inline int eventPrepare(EventCount *event) {
+    event->waiters.fetch_add(1);
+    return event->epoch.load();
+}
+
+static inline void eventCancel(EventCount *event) {
+    event->waiters.fetch_sub(1);
+}
+
+static inline void eventWait(EventCount *event, int key) {
+    parkWait(&event->epoch, key);
+    event->waiters.fetch_sub(1);
+}
+
+/* wakes one or all parked threads, costs one atomic add when nobody is parked */
+static inline void eventNotify(EventCount *event, bool all) {
+    event->epoch.fetch_add(1);
+    if(event->waiters.load() > 0) {
+        parkWake(&event->epoch, all ? INT_MAX : 1);
+    }
+}
+
+/* tasks submitted to a group can be waited for together. The number of pending tasks is also the
+ * word waiting threads park on, so the last task never touches the group after finishing it. That
+ * matters since the group usually lives on the stack of the waiting thread. */
+struct TaskGroup {
+    std::atomic<int> pending;
+};
+
+/* a task runs function(arg, index) */
+struct Task {
+    void (*function)(void *, long);
+    void *arg;
+    long index;
+    TaskGroup *group;
+};
+
+/* a bounded lock-free multi producer multi consumer queue. Every cell carries a sequence number
+ * that tells whether it is free for the producer or filled for the consumer at a given position */
+struct TaskQueue {
+    struct Cell {
+        std::atomic<long> sequence;
+        Task task;
+    };
+    alignas(CACHE_LINE) std::atomic<long> enqueuePos;
+    alignas(CACHE_LINE) std::atomic<long> dequeuePos;
+    alignas(CACHE_LINE) Cell cells[RUNTIME_QUEUE_SIZE];
+};
+
+/* a fixed pool of workers */
+struct Runtime {
+    int nrWorkers;
+    pthread_t workers[RUNTIME_MAX_WORKERS];
+    TaskQueue *queues;            /* one queue for each worker */
+    std::atomic<long> nextQueue;  /* round robin for tasks submitted from outside the pool */
+    std::atomic<bool> stopping;
+    EventCount workAvailable;     /* idle workers park here */
+};
+
+/* the index of the calling worker in its pool, outside threads get the index nrWorkers */
+static thread_local int runtimeWorkerId = -1;
+
+static inline int runtimeSelf(Runtime *runtime) {
+    return (runtimeWorkerId < 0) ? runtime->nrWorkers : runtimeWorkerId;
+}
+
+static inline void queueInit(TaskQueue *queue) {
+    for(long i = 0; i < RUNTIME_QUEUE_SIZE; i++) {
+        queue->cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    queue->enqueuePos.store(0, std::memory_order_relaxed);
+    queue->dequeuePos.store(0, std::memory_order_relaxed);
+}
+
+/* returns false if the queue is full */
+static inline bool queuePush(TaskQueue *queue, const Task &task) {
+    long pos = queue->enqueuePos.load(std::memory_order_relaxed);
+    TaskQueue::Cell *cell;
+    while(true) {
+        cell = &queue->cells[pos & (RUNTIME_QUEUE_SIZE - 1)];
+        long difference = cell->sequence.load(std::memory_order_acquire) - pos;
+        if(difference == 0) {
+            if(queue->enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if(difference < 0) {
+            return false;
+        } else {
+            pos = queue->enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+    cell->task = task;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+/* returns false if the queue is empty */
+static inline bool queuePop(TaskQueue *queue, Task *task) {
+    long pos = queue->dequeuePos.load(std::memory_order_relaxed);
+    TaskQueue::Cell *cell;
+    while(true) {
+        cell = &queue->cells[pos & (RUNTIME_QUEUE_SIZE - 1)];
+        long difference = cell->sequence.load(std::memory_order_acquire) - (pos + 1);
+        if(difference == 0) {
+            if(queue->dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if(difference < 0) {
+            return false;
+        } else {
+            pos = queue->dequeuePos.load(std::memory_order_relaxed);
+        }
+    }
+    *task = cell->task;
+    cell->sequence.store(pos + RUNTIME_QUEUE_SIZE, std::memory_order_release);
+    return true;
+}
+
+/* takes a task from the own queue first and steals from the others otherwise */
+static inline bool runtimeFindTask(Runtime *runtime, Task *task) {
+    int self = runtimeSelf(runtime);
+    for(int k = 0; k < runtime->nrWorkers; k++) {
+        if(queuePop(&runtime->queues[(self + k) % runtime->nrWorkers], task)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline void runtimeRunTask(const Task &task) {
+    task.function(task.arg, task.index);
+    if(task.group != NULL) {
+        std::atomic<int> *pending = &task.group->pending;
+        if(pending->fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            /* only the address is used here, waking does not read the word */
+            parkWake(pending, INT_MAX);
+        }
+    }
+}
+
+struct RuntimeWorkerArg {
+    Runtime *runtime;
+    int id;
+};
+
+/* a worker runs tasks until the runtime stops and parks when there is nothing to run */
+static void *RuntimeWorker(void *arg) {
+    RuntimeWorkerArg *workerArg = (RuntimeWorkerArg *)arg;
+    Runtime *runtime = workerArg->runtime;
+    runtimeWorkerId = workerArg->id;
+    delete workerArg;
+    Task task;
+    while(true) {
+        if(runtimeFindTask(runtime, &task)) {
+            runtimeRunTask(task);
+            continue;
+        }
+        int key = eventPrepare(&runtime->workAvailable);
+        if(runtimeFindTask(runtime, &task)) {
+            eventCancel(&runtime->workAvailable);
+            runtimeRunTask(task);
+        } else if(runtime->stopping.load()) {
+            eventCancel(&runtime->workAvailable);
+            break;
+        } else {
+            eventWait(&runtime->workAvailable, key);
+        }
+    }
+    return NULL;
+}
+
+/* starts the given number of workers, zero workers runs every task on the submitting thread */
+static inline void runtimeStart(Runtime *runtime, int nrWorkers) {
+    pthread_attr_t attr;
+    if(nrWorkers > RUNTIME_MAX_WORKERS) nrWorkers = RUNTIME_MAX_WORKERS;
+    if(nrWorkers < 0) nrWorkers = 0;
+    runtime->nrWorkers = nrWorkers;
+    runtime->queues = new TaskQueue[(nrWorkers > 0) ? nrWorkers : 1];
+    for(int i = 0; i < nrWorkers; i++) {
+        queueInit(&runtime->queues[i]);
+    }
+    runtime->nextQueue.store(0);
+    runtime->stopping.store(false);
+    runtime->workAvailable.epoch.store(0);
+    runtime->workAvailable.waiters.store(0);
+    pthread_attr_init(&attr);
+    pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+    for(int i = 0; i < nrWorkers; i++) {
+        RuntimeWorkerArg *arg = new RuntimeWorkerArg();
+        arg->runtime = runtime;
+        arg->id = i;
+        pthread_create(&runtime->workers[i], &attr, RuntimeWorker, arg);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/* lets the workers finish the queued tasks and joins them */
+static inline void runtimeStop(Runtime *runtime) {
+    runtime->stopping.store(true);
+    eventNotify(&runtime->workAvailable, true);
+    for(int i = 0; i < runtime->nrWorkers; i++) {
+        pthread_join(runtime->workers[i], NULL);
+    }
+    delete[] runtime->queues;
+}
+
+static inline void taskGroupInit(TaskGroup *group) {
+    group->pending.store(0);
+}
+
+/* queues function(arg, index) in the group. A worker queues on its own queue, other threads spread
+ * their tasks round robin. The task is run right away when there is no room or no workers. */
+static inline void runtimeSubmit(Runtime *runtime, TaskGroup *group, void (*function)(void *, long), void *arg, long index) {
+    Task task = {function, arg, index, group};
+    if(group != NULL) {
+        group->pending.fetch_add(1, std::memory_order_relaxed);
+    }
+    if(runtime->nrWorkers > 0) {
+        int queue = (runtimeWorkerId >= 0) ? runtimeWorkerId : (int)(runtime->nextQueue.fetch_add(1) % runtime->nrWorkers);
+        if(queuePush(&runtime->queues[queue], task)) {
+            eventNotify(&runtime->workAvailable, false);
+            return;
+        }
+    }
+    runtimeRunTask(task);
+}
+
+/* waits until every task of the group has run, helping with queued tasks in the meantime */
+static inline void taskGroupWait(Runtime *runtime, TaskGroup *group) {
+    Task task;
+    int pending;
+    while((pending = group->pending.load(std::memory_order_acquire)) > 0) {
+        if(runtimeFindTask(runtime, &task)) {
+            runtimeRunTask(task);
+            continue;
+        }
+        /* returns right away if pending changed since we looked */
+        parkWait(&group->pending, pending);
+    }
+}
+
+/* the shared state of one parallel for, the chunks are taken from a "bag" with an atomic counter */
+struct ParallelFor {
+    alignas(CACHE_LINE) std::atomic<long> next;
+    long end;
+    long grain;
+    void (*function)(void *, long, long);
+    void *arg;
+};
+
+static void parallelForChunks(void *arg, long unused) {
+    ParallelFor *loop = (ParallelFor *)arg;
+    while(true) {
+        long first = loop->next.fetch_add(loop->grain, std::memory_order_relaxed);
+        if(first >= loop->end) {
+            break;
+        }
+        long last = (first + loop->grain < loop->end) ? first + loop->grain : loop->end;
+        loop->function(loop->arg, first, last);
+    }
+}
+
+/* runs function(arg, first, last) over begin up to end in chunks of grain iterations on the workers
+ * and the calling thread, and returns when all chunks are done */
+static inline void parallelFor(Runtime *runtime, long begin, long end, long grain, void (*function)(void *, long, long), void *arg) {
+    if(grain < 1) grain = 1;
+    long nrChunks = (end - begin + grain - 1) / grain;
+    if(nrChunks <= 0) {
+        return;
+    }
+    ParallelFor loop;
+    loop.next.store(begin);
+    loop.end = end;
+    loop.grain = grain;
+    loop.function = function;
+    loop.arg = arg;
+    TaskGroup group;
+    taskGroupInit(&group);
+    long helpers = (nrChunks - 1 < runtime->nrWorkers) ? nrChunks - 1 : runtime->nrWorkers;
+    for(long i = 0; i < helpers; i++) {
+        runtimeSubmit(runtime, &group, parallelForChunks, &loop, 0);
+    }
+    parallelForChunks(&loop, 0);
+    taskGroupWait(runtime, &group);
+}
+
+/* one value per worker and one for the outside thread, each on its own cache line so that the
+ * threads never share a line while accumulating. combine merges them when the work is done. */
+template <typename T>
+struct Reduction {
+    struct alignas(CACHE_LINE) Slot {
+        T value;
+    };
+    Slot *slots;
+    int nrSlots;
+    Runtime *runtime;
+
+    Reduction(Runtime *runtime, const T &identity) : runtime(runtime) {
+        nrSlots = runtime->nrWorkers + 1;
+        slots = new Slot[nrSlots];
+        for(int i = 0; i < nrSlots; i++) {
+            slots[i].value = identity;
+        }
+    }
+
+    ~Reduction() {
+        delete[] slots;
+    }
+
+    /* the value of the calling thread */
+    T &local() {
+        return slots[runtimeSelf(runtime)].value;
+    }
+
+    /* merges all values in a tree, merge(a, b) adds b into a */
+    template <typename Merge>
+    T combine(Merge merge) {
+        for(int step = 1; step < nrSlots; step *= 2) {
+            for(int i = 0; i + step < nrSlots; i += 2 * step) {
+                merge(slots[i].value, slots[i + step].value);
+            }
+        }
+        return slots[0].value;
+    }
+};
+
+#endif